@@ -2,12 +2,25 @@
  * Connection management
  */
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <termios.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
 #include <string>
+#include <vector>
 
+#include <stddef.h>
 #include <string.h> // for memset
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -18,8 +31,6 @@
 #include "connection.h"
 #include "expatwrap.h"
 
-std::ostream &operator<<(std::ostream &, const addrinfo &);
-
 struct AddressLookup {
 public:
     addrinfo *addrInfo;
@@ -63,11 +74,11 @@ AddressLookup::~AddressLookup()
     freeaddrinfo(addrInfo);
 }
 
-std::ostream &operator<<(std::ostream &os, const addrinfo &ai)
+std::ostream &operator<<(std::ostream &os, const Address &a)
 {
     char host[NI_MAXHOST];
     char service[NI_MAXSERV];
-    int rc = getnameinfo(ai.ai_addr, ai.ai_addrlen, host, sizeof host, service,
+    int rc = getnameinfo((const sockaddr *)&a.addr, a.len, host, sizeof host, service,
 		sizeof service, NI_NUMERICHOST|NI_NUMERICSERV);
     if (rc)
         return os << "(name resolution failed)";
@@ -75,24 +86,129 @@ std::ostream &operator<<(std::ostream &os, const addrinfo &ai)
         return os << host << ":" << service;
 }
 
+AddressCache::AddressCache()
+    : expires(0)
+    , resolving(false)
+    , ttl(60)
+{
+    pthread_mutex_init(&lock, 0);
+}
+
+AddressCache::~AddressCache()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+static uint64_t
+milliseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static time_t
+seconds()
+{
+    return milliseconds() / 1000;
+}
+
+/*
+ * Callers get a copy, so another thread can refresh the cache while they
+ * work through it. The lookup itself is done without the lock, and only
+ * one caller at a time refreshes expired addresses: the others carry on
+ * with the old ones meanwhile, and only resolve for themselves if there
+ * are none.
+ */
+std::vector<Address>
+AddressCache::lookup(Waiter &waiter, const std::string &host, const std::string &service, int flags)
+{
+    pthread_mutex_lock(&lock);
+    bool expired = addresses.empty() || seconds() >= expires;
+    bool refresh = expired && (!resolving || addresses.empty() || ttl == 0);
+    if (refresh)
+	resolving = true;
+    std::vector<Address> result(addresses);
+    pthread_mutex_unlock(&lock);
+    if (!refresh)
+	return result;
+
+    result.clear();
+    try {
+	LogLine(waiter).stream() << "resolving host " << host << " for service " << service;
+	AddressLookup al(host, service, flags);
+	for (addrinfo *ai = al.addrInfo; ai; ai = ai->ai_next) {
+	    Address a;
+	    a.family = ai->ai_family;
+	    a.socktype = ai->ai_socktype;
+	    a.protocol = ai->ai_protocol;
+	    a.len = std::min(size_t(ai->ai_addrlen), sizeof a.addr);
+	    memcpy(&a.addr, ai->ai_addr, a.len);
+	    result.push_back(a);
+	}
+    }
+    catch (...) {
+	pthread_mutex_lock(&lock);
+	resolving = false;
+	pthread_mutex_unlock(&lock);
+	throw;
+    }
+    pthread_mutex_lock(&lock);
+    addresses = result;
+    expires = seconds() + ttl;
+    resolving = false;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void
+AddressCache::forget()
+{
+    pthread_mutex_lock(&lock);
+    addresses.clear();
+    pthread_mutex_unlock(&lock);
+}
+
 NetworkConnection::NetworkConnection(const char **settings, int facility)
-    : Connection(facility)
+    : Connection(settings, facility)
     , host("localhost")
     , service("telnet")
+    , poolSize(64)
+    , connectTimeout(-1)
+    , stagger(250)
+    , keepAlive(false)
 {
     const char **cpp;
+    std::string pool;
     for (cpp = settings; *cpp; cpp += 2) {
 	if (!strcmp(cpp[0], "host"))
 	    host = cpp[1];
 	else if (!strcmp(cpp[0], "service"))
 	    service = cpp[1];
+	else if (!strcmp(cpp[0], "pool"))
+	    pool = cpp[1];
+	else if (!strcmp(cpp[0], "poolsize"))
+	    poolSize = atoi(cpp[1]);
+	else if (!strcmp(cpp[0], "keepalive"))
+	    keepAlive = ExpatParserHandlers::boolAttribute(cpp[1]);
+	else if (!strcmp(cpp[0], "ttl"))
+	    addresses.ttl = atoi(cpp[1]);
+	else if (!strcmp(cpp[0], "connect-timeout"))
+	    connectTimeout = atoi(cpp[1]);
+	else if (!strcmp(cpp[0], "stagger"))
+	    stagger = atoi(cpp[1]);
     }
+    if (pool != "")
+	poolKey = pool + " " + host + ":" + service;
 }
 
 ListenConnection::ListenConnection(const char **settings, int facility)
-    : Connection(facility)
+    : Connection(settings, facility)
     , host("")
     , service("8080")
+    , backlog(-1)
+    , persistent(false)
+    , workers(sysconf(_SC_NPROCESSORS_ONLN))
 {
     const char **cpp;
     for (cpp = settings; *cpp; cpp += 2) {
@@ -100,7 +216,19 @@ ListenConnection::ListenConnection(const char **settings, int facility)
 	    host = cpp[1];
 	else if (!strcmp(cpp[0], "service"))
 	    service = cpp[1];
+	else if (!strcmp(cpp[0], "backlog"))
+	    backlog = atoi(cpp[1]);
+	else if (!strcmp(cpp[0], "persistent"))
+	    persistent = ExpatParserHandlers::boolAttribute(cpp[1]);
+	else if (!strcmp(cpp[0], "workers"))
+	    workers = atoi(cpp[1]);
+	else if (!strcmp(cpp[0], "ttl"))
+	    addresses.ttl = atoi(cpp[1]);
     }
+    if (backlog < 0)
+	backlog = persistent ? SOMAXCONN : 10;
+    if (workers < 1)
+	workers = 1;
 }
 
 ListenConnection::~ListenConnection()
@@ -111,70 +239,488 @@ NetworkConnection::~NetworkConnection()
 {
 }
 
-Connection::Connection(int facility)
+Connection::Connection(const char **settings, int facility)
     : facility(facility)
+    , telnet(true)
+    , stripNul(true)
+{
+    const char **cpp;
+    for (cpp = settings; *cpp; cpp += 2) {
+	if (!strcmp(cpp[0], "telnet"))
+	    telnet = ExpatParserHandlers::boolAttribute(cpp[1]);
+	else if (!strcmp(cpp[0], "stripnul"))
+	    stripNul = ExpatParserHandlers::boolAttribute(cpp[1]);
+	else
+	    options.set(cpp[0], cpp[1]);
+    }
+}
+
+SocketOptions::SocketOptions()
+    : nodelay(false)
+    , quickAck(false)
+    , cork(false)
+    , sendBuffer(0)
+    , receiveBuffer(0)
+    , busyPoll(0)
+{
+}
+
+void
+SocketOptions::set(const char *name, const char *value)
 {
+    if (!strcmp(name, "nodelay"))
+	nodelay = ExpatParserHandlers::boolAttribute(value);
+    else if (!strcmp(name, "quickack"))
+	quickAck = ExpatParserHandlers::boolAttribute(value);
+    else if (!strcmp(name, "cork"))
+	cork = ExpatParserHandlers::boolAttribute(value);
+    else if (!strcmp(name, "sndbuf"))
+	sendBuffer = atoi(value);
+    else if (!strcmp(name, "rcvbuf"))
+	receiveBuffer = atoi(value);
+    else if (!strcmp(name, "busy-poll"))
+	busyPoll = atoi(value);
+}
+
+static void
+setOption(Waiter &waiter, int fd, int level, int option, int value, const char *name)
+{
+    if (::setsockopt(fd, level, option, &value, sizeof value) != 0)
+	LogLine(waiter).stream() << "warning: can't set " << name << ": " << strerror(errno);
+}
+
+/*
+ * Buffer sizes must be set before connecting or listening to affect the
+ * window scale offered. Accepted sockets inherit their listener's options,
+ * but we set them again anyway.
+ */
+void
+SocketOptions::apply(Waiter &waiter, int fd) const
+{
+    if (nodelay)
+	setOption(waiter, fd, IPPROTO_TCP, TCP_NODELAY, 1, "nodelay");
+#ifdef TCP_QUICKACK
+    if (quickAck)
+	setOption(waiter, fd, IPPROTO_TCP, TCP_QUICKACK, 1, "quickack");
+#endif
+    if (sendBuffer)
+	setOption(waiter, fd, SOL_SOCKET, SO_SNDBUF, sendBuffer, "sndbuf");
+    if (receiveBuffer)
+	setOption(waiter, fd, SOL_SOCKET, SO_RCVBUF, receiveBuffer, "rcvbuf");
+#ifdef SO_BUSY_POLL
+    if (busyPoll)
+	setOption(waiter, fd, SOL_SOCKET, SO_BUSY_POLL, busyPoll, "busy-poll");
+#endif
 }
 
 Connection::~Connection()
 {
 }
 
+static void
+setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * Alternate between address families, starting with the first address's,
+ * so an unreachable family costs no more than one stagger.
+ */
+static std::vector<Address>
+interleave(const std::vector<Address> &al)
+{
+    std::vector<Address> first, other, result;
+    for (size_t i = 0; i < al.size(); i++)
+	(al[i].family == al[0].family ? first : other).push_back(al[i]);
+    for (size_t i = 0; i < first.size() || i < other.size(); i++) {
+	if (i < first.size())
+	    result.push_back(first[i]);
+	if (i < other.size())
+	    result.push_back(other[i]);
+    }
+    return result;
+}
+
+/*
+ * Whether a failed connect says the address itself is no good, rather than
+ * that the peer or the network is slow.
+ */
+static bool
+unreachable(int err)
+{
+    return err == ECONNREFUSED || err == EHOSTUNREACH || err == ENETUNREACH;
+}
+
+/*
+ * Connections in progress, in an epoll set so a Waiter can wait for them
+ * all through one descriptor. Those not kept are closed.
+ */
+struct ConnectAttempts {
+    int epfd;
+    std::vector<int> fds; // by address; -1 if not in progress.
+    ConnectAttempts(size_t count) : epfd(epoll_create1(EPOLL_CLOEXEC)), fds(count, -1) {}
+    ~ConnectAttempts();
+};
+
+ConnectAttempts::~ConnectAttempts()
+{
+    for (size_t i = 0; i < fds.size(); i++)
+	if (fds[i] != -1)
+	    ::close(fds[i]);
+    if (epfd != -1)
+	::close(epfd);
+}
+
+/*
+ * Idle connections, by pool and destination.
+ */
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, std::vector<int> > pools;
+
+/*
+ * An idle connection is still usable if the other end hasn't closed it, and
+ * hasn't sent anything we didn't ask for.
+ */
+static bool
+stillIdle(int fd)
+{
+    char c;
+    ssize_t rc = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
 int
-NetworkConnection::connect() const
+NetworkConnection::connect(Waiter &waiter) const
 {
     int fd = -1;
-    std::clog << "resolving host " << host << " for service " << service << std::endl;
-    AddressLookup al(host, service, 0);
-    for (addrinfo *ai = al.addrInfo; ai; ai = ai->ai_next) {
-	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) != -1) {
-	    std::clog << "trying " << *ai;
-	    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
-		std::clog << "... success (fd = " << fd << ")" << std::endl;
+    while (pooled()) {
+	pthread_mutex_lock(&poolLock);
+	std::vector<int> &idle = pools[poolKey];
+	if (!idle.empty()) {
+	    fd = idle.back(); // the most recently used is least likely to have timed out.
+	    idle.pop_back();
+	}
+	pthread_mutex_unlock(&poolLock);
+	if (fd == -1)
+	    break;
+	if (stillIdle(fd)) {
+	    LogLine(waiter).stream() << "reusing pooled connection to " << host << ":" << service << " (fd = " << fd << ")";
+	    return fd;
+	}
+	LogLine(waiter).stream() << "discarding stale pooled connection (fd = " << fd << ")";
+	::close(fd);
+	fd = -1;
+    }
+
+    /*
+     * Race the addresses, as in RFC 8305 ("Happy Eyeballs"): each attempt
+     * starts "stagger" msec after the one before, or as soon as the one
+     * before fails, and the first to connect wins.
+     */
+    std::vector<Address> al = interleave(addresses.lookup(waiter, host, service, 0));
+    ConnectAttempts attempts(al.size());
+    if (attempts.epfd == -1)
+	throw UnixException(errno, "epoll_create");
+    uint64_t t = milliseconds();
+    uint64_t deadline = connectTimeout >= 0 ? t + connectTimeout : 0;
+    uint64_t nextStart = t;
+    size_t next = 0;
+    int pending = 0;
+    size_t refused = 0; // attempts that failed with an unreachable() error.
+    for (;;) {
+	t = milliseconds();
+	if (next < al.size() && (pending == 0 || t >= nextStart)) {
+	    const Address &a = al[next];
+	    LogLine(waiter).stream() << "trying " << a;
+	    if ((fd = socket(a.family, a.socktype, a.protocol)) != -1) {
+		setNonBlocking(fd);
+		options.apply(waiter, fd);
+		if (::connect(fd, (const sockaddr *)&a.addr, a.len) == 0) {
+		    LogLine(waiter).stream() << "... success (fd = " << fd << ")";
+		    return fd;
+		}
+		epoll_event ev;
+		ev.events = EPOLLOUT;
+		ev.data.u32 = next;
+		if (errno == EINPROGRESS && epoll_ctl(attempts.epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+		    attempts.fds[next] = fd;
+		    pending++;
+		} else {
+		    if (unreachable(errno))
+			refused++;
+		    LogLine(waiter).stream() << "... failed: " << strerror(errno);
+		    ::close(fd);
+		}
+	    }
+	    next++;
+	    nextStart = t + stagger;
+	    continue;
+	}
+	if (pending == 0)
+	    break;
+	if (deadline && t >= deadline) {
+	    LogLine(waiter).stream() << "... timed out";
+	    throw UnixException(ETIMEDOUT, "connect");
+	}
+	int msec = next < al.size() ? int(nextStart - t) : -1;
+	if (deadline && (msec == -1 || deadline - t < uint64_t(msec)))
+	    msec = deadline - t;
+	if (waiter.wait(attempts.epfd, POLLIN, msec) <= 0)
+	    continue;
+
+	epoll_event events[16];
+	int count = epoll_wait(attempts.epfd, events, sizeof events / sizeof events[0], 0);
+	for (int i = 0; i < count; i++) {
+	    size_t index = events[i].data.u32;
+	    int err;
+	    socklen_t errlen = sizeof err;
+	    if (getsockopt(attempts.fds[index], SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+		err = errno;
+	    if (err == 0) {
+		fd = attempts.fds[index];
+		attempts.fds[index] = -1; // the rest are abandoned.
+		LogLine(waiter).stream() << "... " << al[index] << " connected (fd = " << fd << ")";
 		return fd;
 	    }
-	    std::clog << "... failed" << std::endl;
-	    ::close(fd);
+	    if (unreachable(err))
+		refused++;
+	    LogLine(waiter).stream() << "... " << al[index] << " failed: " << strerror(err);
+	    ::close(attempts.fds[index]);
+	    attempts.fds[index] = -1;
+	    pending--;
+	    nextStart = t; // start the next one now.
 	}
     }
+    if (refused == al.size())
+	addresses.forget(); // in case the host has moved.
     throw ResolverException("no usable address found", 0);
 }
 
+void
+NetworkConnection::release(Waiter &waiter, int fd) const
+{
+    if (pooled() && stillIdle(fd)) {
+	pthread_mutex_lock(&poolLock);
+	std::vector<int> &idle = pools[poolKey];
+	bool kept = idle.size() < poolSize;
+	if (kept)
+	    idle.push_back(fd);
+	pthread_mutex_unlock(&poolLock);
+	if (kept) {
+	    LogLine(waiter).stream() << "released connection to " << host << ":" << service << " (fd = " << fd << ")";
+	    return;
+	}
+    }
+    ::close(fd);
+}
+
+/*
+ * With reusePort, any number of sockets can listen on the same address, and
+ * the kernel shares incoming calls between them.
+ */
 int
-ListenConnection::connect() const
+ListenConnection::listen(Waiter &waiter, bool reusePort) const
 {
     int fd = -1;
-    std::clog << "resolving host " << host << "for service " << service << std::endl;
-    AddressLookup al(host, service, AI_PASSIVE);
-    for (addrinfo *ai = al.addrInfo; ai; ai = ai->ai_next) {
-	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) != -1) {
+    std::vector<Address> al = addresses.lookup(waiter, host, service, AI_PASSIVE);
+    for (std::vector<Address>::iterator ai = al.begin(); ai != al.end(); ++ai) {
+	if ((fd = socket(ai->family, ai->socktype, ai->protocol)) != -1) {
             static int one = 1;
             if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) != 0)
-                 std::clog << "warning: can't set 'reuse address' option: "<< strerror(errno) << "\n";
-
-            std::clog << "trying " << *ai;
-	    if (::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
-		std::clog << "... success" << std::endl;
-                if (::listen(fd, 10) == 0) {
-                    sockaddr_storage sas;
-                    socklen_t sl = sizeof sas;
-                    int fd2 = ::accept(fd, (struct sockaddr *)&sas, &sl);
-                    if (fd2 != -1) {
-                        std::clog << "accepted call with fd " <<  fd2 << std::endl;
-                        close(fd);
-                        return fd2;
-                    }
-                }
+                 LogLine(waiter).stream() << "warning: can't set 'reuse address' option: " << strerror(errno);
+	    if (reusePort && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) != 0) {
+		int err = errno;
+		::close(fd);
+		throw UnixException(err, "setsockopt(SO_REUSEPORT)");
 	    }
-	    std::clog << "... failed" << std::endl;
+
+	    options.apply(waiter, fd);
+
+            LogLine(waiter).stream() << "trying " << *ai;
+	    if (::bind(fd, (const sockaddr *)&ai->addr, ai->len) == 0 && ::listen(fd, backlog) == 0) {
+		LogLine(waiter).stream() << "... success";
+		setNonBlocking(fd);
+		return fd;
+	    }
+	    LogLine(waiter).stream() << "... failed";
 	    ::close(fd);
 	}
     }
     throw ResolverException("no usable address found", 0);
 }
 
+int
+ListenConnection::connect(Waiter &waiter) const
+{
+    int fd = listen(waiter, false);
+    for (;;) {
+	waiter.wait(fd, POLLIN, -1);
+	sockaddr_storage sas;
+	socklen_t sl = sizeof sas;
+	int fd2 = ::accept(fd, (struct sockaddr *)&sas, &sl);
+	if (fd2 != -1) {
+	    LogLine(waiter).stream() << "accepted call with fd " <<  fd2;
+	    close(fd);
+	    setNonBlocking(fd2);
+	    options.apply(waiter, fd2);
+	    return fd2;
+	}
+	if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+	    int err = errno;
+	    close(fd);
+	    throw UnixException(err, "accept");
+	}
+    }
+}
+
+UnixConnection::UnixConnection(const char **settings, int facility)
+    : Connection(settings, facility)
+    , abstract(false)
+{
+    const char **cpp;
+    for (cpp = settings; *cpp; cpp += 2) {
+	if (!strcmp(cpp[0], "path"))
+	    path = cpp[1];
+	else if (!strcmp(cpp[0], "abstract"))
+	    abstract = ExpatParserHandlers::boolAttribute(cpp[1]);
+    }
+}
+
+UnixConnection::~UnixConnection()
+{
+}
+
+/*
+ * An abstract name starts with a NUL, and its length comes from the
+ * address length rather than a terminating NUL.
+ */
+socklen_t
+UnixConnection::address(sockaddr_storage &storage) const
+{
+    sockaddr_un &sun = (sockaddr_un &)storage;
+    size_t len = path.size() + 1; // the leading or terminating NUL.
+    if (len > sizeof sun.sun_path)
+	throw UnixException(ENAMETOOLONG, path.c_str());
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    memcpy(sun.sun_path + abstract, path.data(), path.size());
+    return offsetof(sockaddr_un, sun_path) + len;
+}
+
+int
+UnixConnection::connect(Waiter &waiter) const
+{
+    sockaddr_storage addr;
+    socklen_t len = address(addr);
+    LogLine(waiter).stream() << "connecting to " << (abstract ? "abstract " : "") << "unix socket " << path;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+	throw UnixException(errno, "socket");
+    setNonBlocking(fd);
+    options.apply(waiter, fd);
+    for (;;) {
+	if (::connect(fd, (const sockaddr *)&addr, len) == 0)
+	    break;
+	int err = errno;
+	if (err == EAGAIN) {
+	    waiter.wait(-1, 0, 10); // the listener's backlog is full.
+	    continue;
+	}
+	if (err == EINPROGRESS) {
+	    waiter.wait(fd, POLLOUT, -1);
+	    socklen_t errlen = sizeof err;
+	    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+		err = errno;
+	    if (err == 0)
+		break;
+	}
+	::close(fd);
+	LogLine(waiter).stream() << "... failed";
+	throw UnixException(err, "connect");
+    }
+    LogLine(waiter).stream() << "... success (fd = " << fd << ")";
+    return fd;
+}
+
+UnixListenConnection::UnixListenConnection(const char **settings, int facility)
+    : UnixConnection(settings, facility)
+    , backlog(10)
+{
+    const char **cpp;
+    for (cpp = settings; *cpp; cpp += 2) {
+	if (!strcmp(cpp[0], "backlog"))
+	    backlog = atoi(cpp[1]);
+    }
+}
+
+UnixListenConnection::~UnixListenConnection()
+{
+}
+
+/*
+ * A socket left in the filesystem by an earlier run is removed first, if
+ * nothing is listening on it any more; the one we create is removed once
+ * the call has been accepted.
+ */
+int
+UnixListenConnection::connect(Waiter &waiter) const
+{
+    sockaddr_storage addr;
+    socklen_t len = address(addr);
+    struct stat st;
+    if (!abstract && stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (probe == -1)
+	    throw UnixException(errno, "socket");
+	int err = ::connect(probe, (const sockaddr *)&addr, len) == 0 ? 0 : errno;
+	::close(probe);
+	if (err != ECONNREFUSED)
+	    throw UnixException(EADDRINUSE, "bind"); // someone's still using it.
+	unlink(path.c_str());
+    }
+
+    LogLine(waiter).stream() << "listening on " << (abstract ? "abstract " : "") << "unix socket " << path;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+	throw UnixException(errno, "socket");
+    options.apply(waiter, fd);
+    if (::bind(fd, (const sockaddr *)&addr, len) != 0) {
+	int err = errno;
+	::close(fd);
+	throw UnixException(err, "bind");
+    }
+    if (::listen(fd, backlog) != 0) {
+	int err = errno;
+	::close(fd);
+	if (!abstract)
+	    unlink(path.c_str());
+	throw UnixException(err, "listen");
+    }
+    setNonBlocking(fd);
+    for (;;) {
+	waiter.wait(fd, POLLIN, -1);
+	int fd2 = ::accept(fd, 0, 0);
+	if (fd2 != -1) {
+	    LogLine(waiter).stream() << "accepted call with fd " << fd2;
+	    ::close(fd);
+	    if (!abstract)
+		unlink(path.c_str());
+	    setNonBlocking(fd2);
+	    return fd2;
+	}
+	if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+	    int err = errno;
+	    ::close(fd);
+	    if (!abstract)
+		unlink(path.c_str());
+	    throw UnixException(err, "accept");
+	}
+    }
+}
+
 ModemConnection::ModemConnection(const char **settings, int facility)
-    : Connection(facility)
+    : Connection(settings, facility)
     , device("/dev/cuaa0")
     , speed(9600)
     , bits(8)
@@ -210,15 +756,15 @@ ModemConnection::ModemConnection(const char **settings, int facility)
 }
 
 int
-ModemConnection::connect() const
+ModemConnection::connect(Waiter &waiter) const
 {
-    int fd = open(device.c_str(), O_RDWR);
+    int fd = open(device.c_str(), O_RDWR | O_NONBLOCK);
     if (fd == -1)
 	throw UnixException(errno, "cannot open modem");
 
     termios io;
 
-    std::clog << "using terminal device " << device << ", speed=" << speed << std::endl;
+    LogLine(waiter).stream() << "using terminal device " << device << ", speed=" << speed;
     if (tcgetattr(fd, &io) == -1) {
 	close(fd);
 	throw UnixException(errno, "cannot get modem configuration");
@@ -4,13 +4,67 @@
 #ifndef connection_h_guard
 #define connection_h_guard
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// An address from getaddrinfo, copied so it can outlive the lookup.
+struct Address {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t len;
+    sockaddr_storage addr;
+};
+
+std::ostream &operator<<(std::ostream &, const Address &);
+
+/*
+ * Addresses for a host and service, looked up when first needed and then
+ * shared by every session using the connection until they're "ttl" seconds
+ * old. With a ttl of 0, they're looked up afresh every time.
+ */
+class AddressCache {
+    pthread_mutex_t lock;
+    std::vector<Address> addresses;
+    time_t expires;
+    bool resolving; // someone is refreshing the addresses.
+    AddressCache(const AddressCache &);
+    AddressCache &operator = (const AddressCache &);
+public:
+    int ttl;
+    AddressCache();
+    ~AddressCache();
+    std::vector<Address> lookup(Waiter &, const std::string &host, const std::string &service, int flags);
+    void forget(); // when every address refused us, say.
+};
+
+// TCP tuning for <network> and <listen>. Options left unset aren't touched.
+struct SocketOptions {
+    bool nodelay; // disable Nagle's algorithm.
+    bool quickAck; // ack at once; Linux clears this, so ExpectProgram sets it again after reading.
+    bool cork; // for ExpectProgram::flush, rather than the socket.
+    int sendBuffer; // bytes
+    int receiveBuffer;
+    int busyPoll; // usec
+    SocketOptions();
+    void set(const char *name, const char *value); // ignores anything else.
+    void apply(Waiter &, int fd) const;
+};
+
 class Connection {
 protected:
     int facility;
 public:
-    Connection(int facility);
+    bool telnet; // interpret telnet commands in received data.
+    bool stripNul; // discard NUL bytes from received data.
+    SocketOptions options; // ignored by connections that aren't sockets.
+    Connection(const char **settings, int facility);
     virtual ~Connection();
-    virtual int connect() const = 0;
+    virtual int connect(Waiter &) const = 0; // returns a non-blocking descriptor.
 };
 
 class ResolverException : public Exception {
@@ -22,6 +76,29 @@ public:
     ~ResolverException() throw();
 };
 
+/*
+ * A Unix domain stream socket, named in the filesystem or, with "abstract",
+ * in Linux's abstract namespace.
+ */
+class UnixConnection : public Connection {
+protected:
+    std::string path;
+    bool abstract;
+    socklen_t address(sockaddr_storage &) const;
+public:
+    UnixConnection(const char **settings, int facility);
+    ~UnixConnection();
+    int connect(Waiter &) const;
+};
+
+class UnixListenConnection : public UnixConnection {
+    int backlog;
+public:
+    UnixListenConnection(const char **settings, int facility);
+    ~UnixListenConnection();
+    int connect(Waiter &) const;
+};
+
 class ModemConnection : public Connection {
     std::string device;
     int speed;
@@ -33,25 +110,44 @@ class ModemConnection : public Connection {
 public:
     ModemConnection(const char **settings, int facility);
     ~ModemConnection();
-    int connect() const;
+    int connect(Waiter &) const;
 };
 
+/*
+ * With a pool name, connections that are released go to an idle list
+ * shared by every session in the process, kept separately for each pool
+ * and destination, and connect() reuses them in preference to making new
+ * ones.
+ */
 class NetworkConnection : public Connection {
     std::string host;
     std::string service;
+    std::string poolKey; // empty if not pooled.
+    size_t poolSize; // most idle connections to keep.
+    mutable AddressCache addresses;
+    int connectTimeout; // msec for connecting to any address; -1 for no limit.
+    int stagger; // msec between starting attempts on successive addresses.
 public:
+    bool keepAlive; // release, rather than close, when the program's done with it.
     NetworkConnection(const char **settings, int facility);
     ~NetworkConnection();
-    int connect() const;
+    bool pooled() const { return !poolKey.empty(); }
+    int connect(Waiter &) const;
+    void release(Waiter &, int fd) const; // fd must be idle: nothing unsent or unread.
 };
 
 class ListenConnection : public Connection {
     std::string host;
     std::string service;
+    int backlog;
+    mutable AddressCache addresses;
 public:
+    bool persistent; // keep accepting calls, each handled by its own session.
+    int workers; // threads, and SO_REUSEPORT sockets, for a persistent listener.
     ListenConnection(const char **settings, int facility);
     ~ListenConnection();
-    int connect() const;
+    int listen(Waiter &, bool reusePort) const; // returns a non-blocking listening socket.
+    int connect(Waiter &) const;
 };
 
 #endif
@@ -41,7 +41,17 @@ void
 ExpatParserHandlers_endElementTrampoline(void *userData, const XML_Char *name)
 {
     ExpatParser *parser = static_cast<ExpatParser *>(userData);
-    parser->handlers.endElement(name);
+    if (parser->stop)
+	return;
+    try {
+	parser->handlers.endElement(name);
+    }
+    catch (const Exception &ex) {
+	std::stringstream ss;
+	ss << ex;
+	parser->reason = ss.str();
+	parser->stop = true;
+    }
 }
 
 extern "C" {
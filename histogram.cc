@@ -0,0 +1,71 @@
+/*
+ * Latency histogram with bounded relative error.
+ */
+
+#include "histogram.h"
+
+Histogram::Histogram()
+    : total(0)
+    , largest(0)
+{
+}
+
+size_t
+Histogram::bucket(uint64_t value)
+{
+    if (value < 128)
+	return value;
+    int shift = 63 - __builtin_clzll(value) - 6; // keep the top 7 bits.
+    return 128 + (shift - 1) * 64 + ((value >> shift) - 64);
+}
+
+uint64_t
+Histogram::highest(size_t bucket)
+{
+    if (bucket < 128)
+	return bucket;
+    int shift = (bucket - 128) / 64 + 1;
+    uint64_t top = (bucket - 128) % 64 + 64;
+    return ((top + 1) << shift) - 1;
+}
+
+void
+Histogram::record(uint64_t value)
+{
+    size_t i = bucket(value);
+    if (i >= counts.size())
+	counts.resize(i + 1);
+    counts[i]++;
+    total++;
+    if (value > largest)
+	largest = value;
+}
+
+void
+Histogram::add(const Histogram &other)
+{
+    if (other.counts.size() > counts.size())
+	counts.resize(other.counts.size());
+    for (size_t i = 0; i < other.counts.size(); i++)
+	counts[i] += other.counts[i];
+    total += other.total;
+    if (other.largest > largest)
+	largest = other.largest;
+}
+
+uint64_t
+Histogram::percentile(double p) const
+{
+    if (total == 0)
+	return 0;
+    uint64_t rank = uint64_t(p / 100 * total + 0.5);
+    if (rank < 1)
+	rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+	seen += counts[i];
+	if (seen >= rank)
+	    return highest(i) < largest ? highest(i) : largest;
+    }
+    return largest;
+}
@@ -0,0 +1,34 @@
+/*
+ * Latency histogram with bounded relative error.
+ */
+
+#ifndef histogram_h_guard
+#define histogram_h_guard
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Laid out like an HdrHistogram: values below 128 get a bucket each, and
+ * above that every power of two is split into 64 buckets, so any value is
+ * recorded to within about 1.6%, whatever its size. Recording is a couple
+ * of shifts and an increment; histograms from different threads are
+ * combined with add().
+ */
+class Histogram {
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t largest;
+    static size_t bucket(uint64_t value);
+    static uint64_t highest(size_t bucket); // largest value recorded in a bucket.
+public:
+    Histogram();
+    void record(uint64_t value);
+    void add(const Histogram &);
+    uint64_t count() const { return total; }
+    uint64_t max() const { return largest; }
+    uint64_t percentile(double p) const; // e.g. 99.9; zero if nothing was recorded.
+};
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Serve any number of calls to a <listen persistent="true"> at once.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <iostream>
+
+#include "listener.h"
+#include "scheduler.h"
+
+std::ostream &
+ListenStoppedException::describe(std::ostream &os) const
+{
+    return os << "stopped serving calls";
+}
+
+void
+ExpectRest::execute(ExpectProgram &program) const
+{
+    if (program.telnet)
+	program.telnetOffer();
+    for (const ExpectNode *n = first; n; n = n->nextSibling)
+	program.execute(n);
+}
+
+/*
+ * One call, with the settings of the program that reached the <listen>.
+ */
+class CallSession : public ExpectSession {
+    Trace *trace_;
+public:
+    CallSession(Scheduler &, ListenServer &, int fd);
+    ~CallSession();
+};
+
+CallSession::CallSession(Scheduler &scheduler, ListenServer &server, int fd)
+    : ExpectSession(scheduler, &server.rest, server.parent.receiveBase, server.parent.variables, fd, fd)
+    , trace_(server.parent.trace ? new Trace(server.parent.trace->traceFile()) : 0)
+{
+    const ExpectProgram &parent = server.parent;
+    setBuffers(parent.receiveBase, parent.sendBase, parent.bufferLimit);
+    timeout = parent.timeout;
+    expectDelay = parent.expectDelay;
+    logLevel = parent.logLevel;
+    trace = trace_;
+    telnet = server.connection.telnet;
+    stripNul = server.connection.stripNul;
+    cork = server.connection.options.cork;
+    quickAck = server.connection.options.quickAck;
+    telnetOptions = parent.telnetOptions;
+    telnetOptions.reset();
+}
+
+CallSession::~CallSession()
+{
+    delete trace_;
+}
+
+/*
+ * Accepts calls on one worker's socket, starting a session for each.
+ */
+class AcceptSession : public ExpectSession {
+    ListenServer &server;
+    ListenServer::Worker &worker;
+public:
+    AcceptSession(Scheduler &, ListenServer &, ListenServer::Worker &);
+    void run(const ExpectNode *, int, int);
+    void done(const Exception *error);
+};
+
+AcceptSession::AcceptSession(Scheduler &scheduler, ListenServer &server_, ListenServer::Worker &worker_)
+    : ExpectSession(scheduler, 0, server_.parent.receiveBase, server_.parent.variables)
+    , server(server_)
+    , worker(worker_)
+{
+    logLevel = server.parent.logLevel;
+}
+
+void
+AcceptSession::run(const ExpectNode *, int, int)
+{
+    for (;;) {
+	wait(worker.fd, POLLIN, -1);
+	int fd = accept4(worker.fd, 0, 0, SOCK_NONBLOCK);
+	if (fd != -1) {
+	    LogLine(*this).stream() << "accepted call with fd " << fd;
+	    server.connection.options.apply(*this, fd);
+	    try {
+		scheduler.add(new CallSession(scheduler, server, fd));
+	    }
+	    catch (const Exception &ex) {
+		::close(fd);
+		LogLine(*this).stream() << "dropped call: " << ex;
+	    }
+	    continue;
+	}
+	int err = errno;
+	switch (err) {
+	case EAGAIN:
+	case EINTR:
+	case ECONNABORTED:
+	    break;
+	case EMFILE:
+	case ENFILE:
+	case ENOBUFS:
+	case ENOMEM:
+	    LogLine(*this).stream() << "warning: " << UnixException(err, "accept");
+	    wait(-1, 0, 100); // until some calls have finished, with luck.
+	    break;
+	default:
+	    throw UnixException(err, "accept");
+	}
+    }
+}
+
+void
+AcceptSession::done(const Exception *error)
+{
+    ExpectSession::done(error);
+    if (!error)
+	return;
+    const UnixException *ux = dynamic_cast<const UnixException *>(error);
+    worker.error = ux ? ux->uxError : EIO;
+    worker.sysCall = ux ? ux->sysCall : "accept";
+}
+
+ListenServer::ListenServer(const ListenConnection &connection_, const ExpectNode *rest_, ExpectProgram &parent_)
+    : connection(connection_)
+    , rest(rest_)
+    , parent(parent_)
+{
+}
+
+ListenServer::~ListenServer()
+{
+    for (size_t i = 0; i < workers.size(); i++)
+	if (workers[i].fd != -1)
+	    ::close(workers[i].fd);
+}
+
+void *
+ListenServer::runWorker(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    try {
+	Scheduler scheduler;
+	scheduler.add(new AcceptSession(scheduler, *worker->server, *worker));
+	scheduler.run();
+    }
+    catch (const Exception &ex) {
+	std::clog << "listener: ERROR: " << ex << std::endl;
+	if (worker->error == 0) {
+	    const UnixException *ux = dynamic_cast<const UnixException *>(&ex);
+	    worker->error = ux ? ux->uxError : EIO;
+	    worker->sysCall = ux ? ux->sysCall : "accept";
+	}
+    }
+    return 0;
+}
+
+void
+ListenServer::run()
+{
+    // Calls copy the parent's variables, and can't see into its receive buffer.
+    parent.saveCaptures();
+    // Each call is a scheduled session, and this thread would block them all.
+    for (const ExpectNode *n = rest.first; n; n = n->nextSibling)
+	if (findPersistentListen(n))
+	    throw ExpectSyntaxException("a persistent listen can't follow another");
+    Worker init = { this, -1, 0, "", 0 };
+    workers.assign(connection.workers, init);
+    for (size_t i = 0; i < workers.size(); i++)
+	workers[i].fd = connection.listen(parent, true);
+    LogLine(parent).stream() << "serving calls on " << workers.size() << " threads";
+
+    size_t started;
+    for (started = 0; started < workers.size(); started++) {
+	int rc = pthread_create(&workers[started].thread, 0, runWorker, &workers[started]);
+	if (rc != 0) {
+	    if (started == 0)
+		throw UnixException(rc, "pthread_create");
+	    LogLine(parent).stream() << "warning: only " << started << " threads: " << UnixException(rc, "pthread_create");
+	    break;
+	}
+    }
+    // Calls to a socket nobody accepts on would never be answered.
+    for (size_t i = started; i < workers.size(); i++) {
+	::close(workers[i].fd);
+	workers[i].fd = -1;
+    }
+    for (size_t i = 0; i < started; i++)
+	pthread_join(workers[i].thread, 0);
+    for (size_t i = 0; i < started; i++)
+	if (workers[i].error != 0)
+	    throw UnixException(workers[i].error, workers[i].sysCall.c_str());
+}
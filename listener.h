@@ -0,0 +1,61 @@
+/*
+ * Serve any number of calls to a <listen persistent="true"> at once.
+ */
+
+#ifndef listener_h_guard
+#define listener_h_guard
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "xmlexpect.h"
+#include "connection.h"
+
+/*
+ * Stands in for the nodes after the <listen>: each call runs them, in
+ * order, in a session of its own.
+ */
+class ExpectRest : public ExpectNode {
+public:
+    const ExpectNode *first;
+    ExpectRest(const ExpectNode *first_) : first(first_) {}
+    void execute(ExpectProgram &program) const;
+};
+
+// Thrown when a persistent listener has stopped without any worker failing.
+class ListenStoppedException : public ExpectException {
+public:
+    std::ostream &describe(std::ostream &) const;
+    ~ListenStoppedException() throw () {}
+};
+
+/*
+ * Each worker thread has its own listening socket, bound to the same
+ * address with SO_REUSEPORT, and its own Scheduler, so the kernel spreads
+ * calls across the threads and they share nothing while serving them. A
+ * session in each scheduler does the accepting. Sessions start with the
+ * settings of the program that reached the <listen>.
+ */
+class ListenServer {
+    friend class AcceptSession;
+    friend class CallSession;
+    const ListenConnection &connection;
+    ExpectRest rest;
+    ExpectProgram &parent;
+    struct Worker {
+	ListenServer *server;
+	int fd;
+	int error; // why accepting stopped, if it failed...
+	std::string sysCall; // ... and in what.
+	pthread_t thread;
+    };
+    std::vector<Worker> workers;
+    static void *runWorker(void *);
+public:
+    ListenServer(const ListenConnection &, const ExpectNode *rest, ExpectProgram &parent);
+    ~ListenServer();
+    void run(); // once every worker has stopped accepting; throws the first failure.
+};
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * Run one script as many concurrent sessions, across several threads.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <typeinfo>
+
+#include "loadgen.h"
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// How long one <expect>, <choose> or <network> in the script took.
+struct StepStats {
+    Histogram latency; // usec
+    int unmatched; // timed out or failed; these are in "latency" too.
+    StepStats() : unmatched(0) {}
+};
+
+// What a thread's sessions did; merged once the threads have finished.
+struct LoadStats {
+    int completed;
+    int timedOut;
+    int failed;
+    unsigned long long bytesSent;
+    unsigned long long bytesReceived;
+    unsigned long long receiveDropped; // unmatched bytes discarded for lack of space.
+    int receiveHighWater; // most unconsumed data any session held at once.
+    Histogram durations; // of each session, in usec.
+    std::map<int, StepStats> steps; // by line number in the script.
+    StepStats connects;
+    LoadStats() : completed(0), timedOut(0), failed(0), bytesSent(0), bytesReceived(0),
+	receiveDropped(0), receiveHighWater(0) {}
+    void add(const LoadStats &);
+};
+
+void
+LoadStats::add(const LoadStats &other)
+{
+    completed += other.completed;
+    timedOut += other.timedOut;
+    failed += other.failed;
+    bytesSent += other.bytesSent;
+    bytesReceived += other.bytesReceived;
+    receiveDropped += other.receiveDropped;
+    receiveHighWater = std::max(receiveHighWater, other.receiveHighWater);
+    durations.add(other.durations);
+    connects.latency.add(other.connects.latency);
+    connects.unmatched += other.connects.unmatched;
+    for (std::map<int, StepStats>::const_iterator i = other.steps.begin(); i != other.steps.end(); ++i) {
+	StepStats &step = steps[i->first];
+	step.latency.add(i->second.latency);
+	step.unmatched += i->second.unmatched;
+    }
+}
+
+class LoadWorker : public SessionSource {
+public:
+    LoadGenerator &generator;
+    int index;
+    pthread_t thread;
+    LoadStats stats;
+    LoadWorker(LoadGenerator &generator_, int index_)
+	: generator(generator_), index(index_) {}
+    ExpectSession *next(Scheduler &, int &wait);
+};
+
+/*
+ * A session that records how it went in its thread's statistics.
+ */
+class LoadSession : public ExpectSession {
+    LoadStats &stats;
+    Trace *trace_;
+    double intended; // when the session was due to start.
+    double stepStart;
+    bool started; // whether any step has started.
+    double connectStart;
+public:
+    LoadSession(Scheduler &, LoadGenerator &, LoadStats &, double intended, const ExpectNode *code,
+	    std::map<std::string, std::string> &variables, TraceFile *);
+    ~LoadSession();
+    void done(const Exception *error);
+    void expectStarted(const ExpectNode *);
+    void expectFinished(const ExpectNode *, bool matched);
+    void connectStarted(const ExpectNode *);
+    void connectFinished(const ExpectNode *, bool connected);
+};
+
+LoadSession::LoadSession(Scheduler &scheduler, LoadGenerator &generator, LoadStats &stats_, double intended_,
+	const ExpectNode *code, std::map<std::string, std::string> &variables, TraceFile *traceFile)
+    : ExpectSession(scheduler, code, generator.receiveSize, variables)
+    , stats(stats_)
+    , trace_(traceFile ? new Trace(*traceFile) : 0)
+    , intended(intended_)
+    , stepStart(0)
+    , started(false)
+    , connectStart(0)
+{
+    setBuffers(generator.receiveSize, generator.sendSize, generator.maxSize);
+    logLevel = generator.logLevel;
+    trace = trace_;
+}
+
+LoadSession::~LoadSession()
+{
+    delete trace_;
+}
+
+void
+LoadSession::done(const Exception *error)
+{
+    ExpectSession::done(error);
+    stats.durations.record(uint64_t((now() - intended) * 1e6));
+    stats.bytesSent += bytesSent;
+    stats.bytesReceived += bytesReceived;
+    stats.receiveDropped += receiveDropped;
+    stats.receiveHighWater = std::max(stats.receiveHighWater, receiveHighWater);
+    const UnixException *ux = dynamic_cast<const UnixException *>(error);
+    if (!error)
+	stats.completed++;
+    else if (dynamic_cast<const ExpectTimeoutException *>(error) || (ux && ux->uxError == ETIMEDOUT))
+	stats.timedOut++;
+    else
+	stats.failed++;
+}
+
+/*
+ * The first step is timed from when the session was due to start, so any
+ * delay in starting it, or in connecting, counts against that step.
+ */
+void
+LoadSession::expectStarted(const ExpectNode *)
+{
+    stepStart = started ? now() : intended;
+    started = true;
+}
+
+void
+LoadSession::expectFinished(const ExpectNode *node, bool matched)
+{
+    StepStats &step = stats.steps[node->lineNumber];
+    step.latency.record(uint64_t((now() - stepStart) * 1e6));
+    if (!matched)
+	step.unmatched++;
+}
+
+void
+LoadSession::connectStarted(const ExpectNode *)
+{
+    connectStart = now();
+}
+
+void
+LoadSession::connectFinished(const ExpectNode *, bool connected)
+{
+    stats.connects.latency.record(uint64_t((now() - connectStart) * 1e6));
+    if (!connected)
+	stats.connects.unmatched++;
+}
+
+LoadGenerator::LoadGenerator(const ExpectNode *code_, std::map<std::string, std::string> &variables_,
+	TraceFile *traceFile_)
+    : code(code_)
+    , variables(variables_)
+    , traceFile(traceFile_)
+    , started(0)
+    , begin(0)
+    , sessions(1)
+    , threads(1)
+    , pin(false)
+    , uring(false)
+    , receiveSize(1024)
+    , sendSize(1024)
+    , maxSize(1 << 20)
+    , logLevel(2)
+    , rate(0)
+{
+    // It would block the thread, and every other session on it, for good.
+    if (findPersistentListen(code))
+	throw ExpectSyntaxException("a persistent listen can't run in many sessions");
+}
+
+/*
+ * Take the next unstarted session if it's due, returning its number and
+ * setting "intended" to when it was due. Otherwise return -1, with "wait"
+ * set as SessionSource::next describes.
+ */
+int
+LoadGenerator::claim(double &intended, int &wait)
+{
+    for (;;) {
+	int i = started;
+	if (i >= sessions) {
+	    wait = -1;
+	    return -1;
+	}
+	double t = now();
+	intended = rate > 0 ? begin + i / rate : t;
+	if (intended > t) {
+	    wait = int(ceil((intended - t) * 1e3));
+	    return -1;
+	}
+	if (__sync_bool_compare_and_swap(&started, i, i + 1))
+	    return i;
+    }
+}
+
+ExpectSession *
+LoadWorker::next(Scheduler &scheduler, int &wait)
+{
+    double intended;
+    if (generator.claim(intended, wait) == -1)
+	return 0;
+    return new LoadSession(scheduler, generator, stats, intended, generator.code,
+	    generator.variables, generator.traceFile);
+}
+
+void *
+LoadGenerator::runWorker(void *arg)
+{
+    LoadWorker *worker = (LoadWorker *)arg;
+    LoadGenerator &generator = worker->generator;
+
+    if (generator.pin) {
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(worker->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+	if (rc != 0)
+	    std::clog << "warning: can't pin thread " << worker->index << ": " << UnixException(rc, "pthread_setaffinity_np") << std::endl;
+#endif
+    }
+    try {
+	Scheduler scheduler(generator.uring);
+	scheduler.run(worker);
+    }
+    catch (const Exception &ex) {
+	std::clog << "thread " << worker->index << ": ERROR: " << ex << std::endl;
+    }
+    return 0;
+}
+
+// Latency percentiles from a histogram of usec, in msec.
+static void
+reportLatency(std::ostream &report, const Histogram &latency)
+{
+    report << "p50 " << latency.percentile(50) / 1e3
+	<< ", p90 " << latency.percentile(90) / 1e3
+	<< ", p99 " << latency.percentile(99) / 1e3
+	<< ", p99.9 " << latency.percentile(99.9) / 1e3
+	<< ", max " << latency.max() / 1e3;
+}
+
+/*
+ * Run every session to completion, then write a summary to "report".
+ */
+void
+LoadGenerator::run(std::ostream &report)
+{
+    std::vector<LoadWorker *> workers;
+    begin = now();
+
+    for (int i = 0; i < threads; i++) {
+	workers.push_back(new LoadWorker(*this, i));
+	int rc = pthread_create(&workers[i]->thread, 0, runWorker, workers[i]);
+	if (rc != 0) {
+	    delete workers.back();
+	    workers.pop_back();
+	    std::clog << "warning: only " << i << " threads: " << UnixException(rc, "pthread_create") << std::endl;
+	    break;
+	}
+    }
+    LoadStats total;
+    for (size_t i = 0; i < workers.size(); i++) {
+	pthread_join(workers[i]->thread, 0);
+	total.add(workers[i]->stats);
+	delete workers[i];
+    }
+    double elapsed = now() - begin;
+
+    report << std::fixed << std::setprecision(1)
+	<< "sessions: " << total.durations.count() << " in " << elapsed << "s on " << workers.size() << " threads ("
+	<< total.durations.count() / elapsed << "/s";
+    if (rate > 0)
+	report << ", target " << rate << "/s";
+    report << ")" << std::endl
+	<< "completed: " << total.completed << ", timed out: " << total.timedOut
+	<< ", failed: " << total.failed << std::endl
+	<< "sent: " << total.bytesSent << " bytes (" << total.bytesSent / elapsed / 1e3 << " kB/s), "
+	<< "received: " << total.bytesReceived << " bytes (" << total.bytesReceived / elapsed / 1e3 << " kB/s)" << std::endl
+	<< "receive buffer: at most " << total.receiveHighWater << " bytes unconsumed, "
+	<< total.receiveDropped << " discarded for lack of space" << std::endl
+	<< "session time (ms): ";
+    reportLatency(report, total.durations);
+    report << std::endl;
+    if (total.connects.latency.count()) {
+	report << "connect (ms): " << total.connects.latency.count() << " runs, ";
+	reportLatency(report, total.connects.latency);
+	if (total.connects.unmatched)
+	    report << "; " << total.connects.unmatched << " failed";
+	report << std::endl;
+    }
+    for (std::map<int, StepStats>::const_iterator i = total.steps.begin(); i != total.steps.end(); ++i) {
+	report << "line " << i->first << " (ms): " << i->second.latency.count() << " runs, ";
+	reportLatency(report, i->second.latency);
+	if (i->second.unmatched)
+	    report << "; " << i->second.unmatched << " unmatched";
+	report << std::endl;
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Run one script as many concurrent sessions, across several threads, and
+ * report how it went.
+ */
+
+#ifndef loadgen_h_guard
+#define loadgen_h_guard
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "scheduler.h"
+#include "histogram.h"
+
+class LoadWorker;
+
+/*
+ * Each thread runs its own Scheduler. Sessions aren't assigned to threads up
+ * front: each thread takes unstarted ones from a shared count whenever it
+ * has a moment, so a thread that's busy with its own sessions leaves the
+ * rest to the others.
+ *
+ * Given a rate, sessions are started on a fixed schedule however slowly
+ * earlier ones are going, and latencies are measured from when a session
+ * was due to start rather than when it did: a stalled server then shows up
+ * in the figures instead of merely slowing the test down.
+ */
+class LoadGenerator {
+    friend class LoadWorker;
+    const ExpectNode *code;
+    std::map<std::string, std::string> &variables;
+    TraceFile *traceFile;
+    int started; // sessions handed out so far; shared by all threads.
+    double begin; // when run() was called.
+    int claim(double &intended, int &wait); // see SessionSource::next
+
+    static void *runWorker(void *);
+public:
+    int sessions;
+    int threads;
+    bool pin; // pin thread i to CPU i (modulo the CPUs there are).
+    bool uring;
+    int receiveSize;
+    int sendSize;
+    int maxSize;
+    int logLevel;
+    double rate; // sessions started per second; 0 starts them as fast as they finish.
+    LoadGenerator(const ExpectNode *code, std::map<std::string, std::string> &variables, TraceFile *);
+    void run(std::ostream &report);
+};
+
+#endif
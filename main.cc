@@ -3,34 +3,133 @@
  */
 
 #include "xmlexpect.h"
+#include "loadgen.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 
 static int
 usage()
 {
-    std::clog << "xmlexpect <file>" << std::endl;
+    std::clog << "xmlexpect [-r receive-buffer] [-s send-buffer] [-m max-buffer] [-t trace-file] [-v level]" << std::endl
+	<< "          [-n|--sessions count [-T|--threads count] [-p|--pin] [-u|--uring] [-R|--rate per-second]] <file>" << std::endl
+	<< "  -n  run the script as this many sessions at once, and report how they went;" << std::endl
+	<< "      -T, -p, -u and -R only apply with it" << std::endl
+	<< "  -T  threads to run the sessions on (default 1)" << std::endl
+	<< "  -p  pin each thread to its own CPU" << std::endl
+	<< "  -u  use io_uring for the sessions' I/O, where the kernel has it" << std::endl
+	<< "  -R  start sessions at this rate, however slowly earlier ones are going" << std::endl;
     return -1;
 }
 
+static const struct option longOptions[] = {
+    { "sessions", required_argument, 0, 'n' },
+    { "threads", required_argument, 0, 'T' },
+    { "pin", no_argument, 0, 'p' },
+    { "uring", no_argument, 0, 'u' },
+    { "rate", required_argument, 0, 'R' },
+    { 0, 0, 0, 0 }
+};
+
 int
 main(int argc, char *argv[])
 {
     std::map<std::string, std::string> variables;
-    if (argc != 2)
+    int receiveSize = 1024, sendSize = 1024, maxSize = 1 << 20;
+    int logLevel = 2;
+    const char *traceName = 0;
+    TraceFile *traceFile = 0;
+    Trace *trace = 0;
+    int sessions = 0;
+    int threads = 1;
+    bool pin = false;
+    bool uring = false;
+    double rate = 0;
+    bool loadOption = false; // any option that only applies with -n.
+    int c;
+
+    while ((c = getopt_long(argc, argv, "r:s:m:t:v:n:T:puR:", longOptions, 0)) != -1) {
+	switch (c) {
+	case 'r':
+	    receiveSize = atoi(optarg);
+	    break;
+	case 's':
+	    sendSize = atoi(optarg);
+	    break;
+	case 'm':
+	    maxSize = atoi(optarg);
+	    break;
+	case 't':
+	    traceName = optarg;
+	    break;
+	case 'v':
+	    logLevel = atoi(optarg);
+	    break;
+	case 'n':
+	    sessions = atoi(optarg);
+	    break;
+	case 'T':
+	    threads = atoi(optarg);
+	    loadOption = true;
+	    break;
+	case 'p':
+	    pin = true;
+	    loadOption = true;
+	    break;
+	case 'u':
+	    uring = true;
+	    loadOption = true;
+	    break;
+	case 'R':
+	    rate = atof(optarg);
+	    loadOption = true;
+	    break;
+	default:
+	    return usage();
+	}
+    }
+    if (argc - optind != 1 || receiveSize <= 0 || sendSize <= 0 || threads <= 0 || rate < 0)
 	return usage();
+    if (loadOption && sessions == 0) {
+	std::clog << "-T, -p, -u and -R only apply to sessions started with -n" << std::endl;
+	return usage();
+    }
     try {
         ExpectHandlers handlers;
 	ExpatParser parser(handlers);
-        parser.parseFile(argv[1]);
-	ExpectProgram expect(1024, variables);
-	int r = dup(0);
-	int w = dup(1);
-	expect.run(handlers.root(), r, w);
-	std::clog << "completed" << std::endl;
-	return 0;
+        parser.parseFile(argv[optind]);
+	if (traceName)
+	    traceFile = new TraceFile(traceName);
+	if (sessions == 0) {
+	    ExpectProgram expect(receiveSize, variables);
+	    expect.setBuffers(receiveSize, sendSize, maxSize);
+	    expect.logLevel = logLevel;
+	    if (traceFile)
+		expect.trace = trace = new Trace(*traceFile);
+	    int r = dup(0);
+	    int w = dup(1);
+	    expect.run(handlers.root(), r, w);
+	    std::clog << "completed" << std::endl;
+	} else {
+	    // Many copies of the script at once: each must make its own connection.
+	    LoadGenerator load(handlers.root(), variables, traceFile);
+	    load.sessions = sessions;
+	    load.threads = threads;
+	    load.pin = pin;
+	    load.uring = uring;
+	    load.receiveSize = receiveSize;
+	    load.sendSize = sendSize;
+	    load.maxSize = maxSize;
+	    load.logLevel = logLevel;
+	    load.rate = rate;
+	    load.run(std::cout);
+	}
     }
     catch (const Exception &ex) {
 	std::clog << "ERROR: " << ex << std::endl;
     }
+    delete trace; // writes out what's left of the trace.
+    delete traceFile;
+    return 0;
 }
-
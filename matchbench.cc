@@ -0,0 +1,87 @@
+/*
+ * Micro-benchmark for expect pattern matching: compares compiling the regex
+ * on every attempt (as ExpectProgram::match once did), a precompiled regex,
+ * and the literal search used for patterns with no metacharacters.
+ */
+
+#include <sys/time.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "pattern.h"
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+report(const char *what, size_t size, int iterations, double elapsed)
+{
+    printf("%-24s %8lu bytes %10.1f ns/match %8.1f MB/s\n", what, (unsigned long)size,
+	    elapsed * 1e9 / iterations, size * (double)iterations / elapsed / 1e6);
+}
+
+static void
+bench(size_t size, const std::string &needle, int iterations)
+{
+    std::string text;
+    while (text.size() + needle.size() < size)
+	text += "Content-Type: text/plain\r\n";
+    text.resize(size - needle.size());
+    text += needle;
+    const char *data = text.c_str();
+    double start;
+    int found = 0;
+
+    start = now();
+    for (int i = 0; i < iterations; i++) {
+	regex_t re;
+	if (regcomp(&re, needle.c_str(), REG_NOSUB) == 0)
+	    found += regexec(&re, data, 0, 0, 0) == 0;
+	regfree(&re);
+    }
+    report("regcomp+regexec", size, iterations, now() - start);
+
+    regex_t re;
+    regcomp(&re, needle.c_str(), REG_NOSUB);
+    start = now();
+    for (int i = 0; i < iterations; i++)
+	found += regexec(&re, data, 0, 0, 0) == 0;
+    report("precompiled regexec", size, iterations, now() - start);
+    regfree(&re);
+
+    Pattern literal(needle);
+    start = now();
+    for (int i = 0; i < iterations; i++)
+	found += literal.execute(data, 0, size);
+    report("literal", size, iterations, now() - start);
+
+    Pattern nocase(needle, REG_ICASE);
+    start = now();
+    for (int i = 0; i < iterations; i++)
+	found += nocase.execute(data, 0, size);
+    report("literal, nocase", size, iterations, now() - start);
+
+    if (found != iterations * 4)
+	fprintf(stderr, "warning: only %d of %d attempts matched\n", found, iterations * 4);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    size_t sizes[] = { 64, 1024, 16384, 262144 };
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+	bench(sizes[i], "\r\n\r\n", sizes[i] > 16384 ? iterations / 16 : iterations);
+	printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Token bucket for limiting the rate at which data is sent.
+ */
+
+#include <math.h>
+
+#include "pacer.h"
+
+static double
+elapsed(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+Pacer::Pacer()
+    : rate(0)
+    , burst(0)
+    , tokens(0)
+{
+    clock_gettime(CLOCK_MONOTONIC, &last);
+}
+
+void
+Pacer::set(double rate_, double burst_)
+{
+    rate = rate_;
+    burst = burst_ < 1 ? 1 : burst_;
+    tokens = burst; // start full, so the first write goes out at once.
+    clock_gettime(CLOCK_MONOTONIC, &last);
+}
+
+void
+Pacer::refill()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tokens += elapsed(last, now) * rate;
+    if (tokens > burst)
+	tokens = burst;
+    last = now;
+}
+
+size_t
+Pacer::available()
+{
+    if (!active())
+	return (size_t)-1;
+    refill();
+    return (size_t)tokens;
+}
+
+void
+Pacer::consume(size_t bytes)
+{
+    if (active())
+	tokens -= bytes;
+}
+
+int
+Pacer::delay(size_t bytes) const
+{
+    if (!active() || tokens >= bytes)
+	return 0;
+    if (bytes > burst)
+	bytes = (size_t)burst;
+    return (int)ceil((bytes - tokens) * 1000 / rate);
+}
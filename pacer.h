@@ -0,0 +1,32 @@
+/*
+ * Token bucket for limiting the rate at which data is sent.
+ */
+
+#ifndef pacer_h_guard
+#define pacer_h_guard
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * The bucket fills at "rate" bytes per second, up to "burst" bytes. Sending
+ * takes bytes out of the bucket; when it's empty, delay() says how long until
+ * there's enough for the next write. The pacer never sleeps itself, so the
+ * caller can get on with something else in the meantime.
+ */
+class Pacer {
+    double rate; // zero if unlimited.
+    double burst;
+    double tokens;
+    struct timespec last;
+    void refill();
+public:
+    Pacer();
+    void set(double rate, double burst);
+    bool active() const { return rate != 0; }
+    size_t available(); // bytes that may be sent now.
+    void consume(size_t bytes);
+    int delay(size_t bytes) const; // msec until that many, or a full burst, are available.
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * Compiled expect patterns.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "pattern.h"
+#include "search.h"
+
+static unsigned nextSerial;
+
+/*
+ * Look at the structure of a POSIX basic regular expression: count its
+ * subexpressions, note any back references or unbalanced \( and \), and work out an upper bound on
+ * the number of bytes it can match (-1 if there is none). Overestimating the
+ * length is harmless: it only limits how much already-searched data must be
+ * searched again after more arrives.
+ */
+static int
+analyze(const std::string &re, int &groups, bool &backrefs, bool &balanced)
+{
+    struct Frame {
+	int best; // longest alternative seen so far in this group.
+	int cur; // length of the current alternative.
+	int last; // length of the most recent atom, for repetition.
+	Frame() : best(0), cur(0), last(0) {}
+    };
+    std::vector<Frame> stack(1);
+    size_t i = 0, len = re.size();
+    bool unbounded = false;
+
+    groups = 0;
+    backrefs = false;
+    balanced = true;
+    while (i < len) {
+	Frame &f = stack.back();
+	char c = re[i++];
+	int atom = 1;
+	switch (c) {
+	case '[':
+	    // Bracket expression: a single character however long it's spelled.
+	    if (i < len && re[i] == '^')
+		i++;
+	    if (i < len && re[i] == ']')
+		i++;
+	    while (i < len && re[i] != ']') {
+		if (re[i] == '[' && i + 1 < len && re[i + 1] && strchr(":=.", re[i + 1])) {
+		    size_t close = re.find(std::string(1, re[i + 1]) + "]", i + 2);
+		    i = close == std::string::npos ? len : close + 2;
+		} else {
+		    i++;
+		}
+	    }
+	    i++;
+	    break;
+	case '*':
+	    if (f.cur == 0 && f.last == 0)
+		break; // literal at the start of an expression.
+	    unbounded = true;
+	    continue;
+	case '\\':
+	    if (i == len)
+		break;
+	    c = re[i++];
+	    switch (c) {
+	    case '(':
+		groups++;
+		stack.push_back(Frame());
+		continue;
+	    case ')':
+		if (stack.size() > 1) {
+		    atom = std::max(f.best, f.cur);
+		    stack.pop_back();
+		} else {
+		    balanced = false;
+		}
+		break;
+	    case '|':
+		f.best = std::max(f.best, f.cur);
+		f.cur = f.last = 0;
+		continue;
+	    case '{': {
+		size_t close = re.find("\\}", i);
+		if (close == std::string::npos) {
+		    i = len;
+		    continue;
+		}
+		std::string range = re.substr(i, close - i);
+		i = close + 2;
+		size_t comma = range.find(',');
+		int count;
+		if (comma == std::string::npos) {
+		    count = atoi(range.c_str());
+		} else if (comma + 1 == range.size()) {
+		    unbounded = true;
+		    continue;
+		} else {
+		    count = atoi(range.c_str() + comma + 1);
+		}
+		f.cur += f.last * (count - 1);
+		f.last *= count;
+		continue;
+	    }
+	    case '+':
+		unbounded = true;
+		continue;
+	    case '?':
+		continue;
+	    case '1': case '2': case '3': case '4': case '5':
+	    case '6': case '7': case '8': case '9':
+		backrefs = unbounded = true;
+		continue;
+	    case 'b': case 'B': case '<': case '>': case '`': case '\'':
+		atom = 0; // zero-width assertions.
+		break;
+	    }
+	    break;
+	}
+	Frame &top = stack.back();
+	top.cur += atom;
+	top.last = atom;
+    }
+    if (stack.size() > 1)
+	balanced = false;
+    return unbounded ? -1 : std::max(stack.front().best, stack.front().cur);
+}
+
+/*
+ * "\|" is a GNU extension to POSIX basic regular expressions, which have no
+ * alternation of their own: this relies on glibc's regcomp.
+ */
+bool
+alternation(const std::vector<std::string> &sources, const std::vector<bool> &usable,
+	std::string &combined, std::vector<int> &groups)
+{
+    int group = 1;
+
+    combined = "";
+    groups.clear();
+    for (size_t i = 0; i < sources.size(); i++) {
+	int inner;
+	bool backrefs, balanced;
+	analyze(sources[i], inner, backrefs, balanced);
+	/*
+	 * Leave out back references, which would refer to the wrong
+	 * subexpression, NULs, where regcomp would stop, and anything that
+	 * wouldn't compile by itself, or would only compile spliced in here.
+	 */
+	if (backrefs || !balanced || !usable[i] || sources[i].find('\0') != std::string::npos) {
+	    groups.push_back(-1);
+	    continue;
+	}
+	if (group != 1)
+	    combined += "\\|";
+	combined += "\\(" + sources[i] + "\\)";
+	groups.push_back(group);
+	group += inner + 1;
+    }
+    return group != 1;
+}
+
+Pattern::Pattern(const std::string &source_, int flags_)
+    : source(source_)
+    , flags(flags_)
+    , serial(__sync_add_and_fetch(&nextSerial, 1))
+{
+    bool backrefs, balanced;
+    maxLength = analyze(source, groups, backrefs, balanced);
+    literal = source.find_first_of(".[\\*^$") == std::string::npos;
+    if (literal) {
+	maxLength = source.size(); // also counts any NULs the text contains.
+	valid = true;
+	return;
+    }
+    valid = balanced && regcomp(&re, source.c_str(), flags) == 0;
+    if (!valid)
+	std::clog << "warning: cannot compile pattern \"" << source << "\"" << std::endl;
+}
+
+Pattern::~Pattern()
+{
+    if (valid && !literal)
+	regfree(&re);
+}
+
+/*
+ * Search data[start..end) for a match. Bytes before start are still visible
+ * to context-dependent assertions. If the pattern was compiled to report
+ * subexpressions, their offsets (from data) are stored in matches.
+ */
+bool
+Pattern::execute(const char *data, int start, int end, regmatch_t *matches, size_t nmatch) const
+{
+    if (!valid)
+	return false;
+    if (literal) {
+	const char *found = findLiteral(data + start, end - start,
+		source.data(), source.size(), flags & REG_ICASE);
+	if (found == 0)
+	    return false;
+	for (size_t i = 0; i < nmatch; i++)
+	    matches[i].rm_so = matches[i].rm_eo = -1;
+	if (nmatch != 0) {
+	    matches[0].rm_so = found - data;
+	    matches[0].rm_eo = found - data + source.size();
+	}
+	return true;
+    }
+    regmatch_t range;
+    if (nmatch == 0) {
+	matches = &range;
+	nmatch = 1;
+    }
+    matches[0].rm_so = start;
+    matches[0].rm_eo = end;
+    return regexec(&re, data, nmatch, matches, REG_STARTEND | (start ? REG_NOTBOL : 0)) == 0;
+}
+
+PatternCache::PatternCache(size_t maxEntries_)
+    : maxEntries(maxEntries_)
+{
+}
+
+PatternCache::~PatternCache()
+{
+    for (Entries::iterator i = entries.begin(); i != entries.end(); ++i)
+	delete *i;
+}
+
+const Pattern &
+PatternCache::get(const std::string &source, int flags)
+{
+    Key key(source, flags);
+    std::map<Key, Entries::iterator>::iterator found = index.find(key);
+    if (found != index.end()) {
+	entries.splice(entries.begin(), entries, found->second);
+	return *entries.front();
+    }
+    if (entries.size() >= maxEntries) {
+	Pattern *victim = entries.back();
+	index.erase(Key(victim->source, victim->flags));
+	entries.pop_back();
+	delete victim;
+    }
+    entries.push_front(new Pattern(source, flags));
+    index[key] = entries.begin();
+    return *entries.front();
+}
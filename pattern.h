@@ -0,0 +1,62 @@
+/*
+ * Compiled expect patterns, and a cache for patterns that are only known at
+ * run time.
+ */
+
+#ifndef pattern_h_guard
+#define pattern_h_guard
+
+#include <sys/types.h>
+#include <regex.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+class Pattern {
+    regex_t re;
+    bool valid;
+    bool literal; // no metacharacters: search for the text itself.
+    Pattern(const Pattern &); // not copyable: owns the compiled regex.
+    Pattern &operator = (const Pattern &);
+public:
+    const std::string source;
+    const int flags; // as passed to regcomp; REG_ICASE also applies to literals.
+    const unsigned serial; // unique for the life of the process.
+    int maxLength; // longest possible match, or -1 if unbounded.
+    int groups; // number of parenthesized subexpressions.
+    Pattern(const std::string &source, int flags = 0);
+    ~Pattern();
+    bool usable() const { return valid; } // false if it didn't compile, and never matches.
+    bool execute(const char *data, int start, int end, regmatch_t *matches = 0, size_t nmatch = 0) const;
+};
+
+/*
+ * Join patterns into a single alternation that finds whichever of them
+ * matches earliest. groups receives the subexpression that brackets each
+ * pattern, or -1 for one that's left out and must be searched for
+ * separately: one with a NUL or back references, or that isn't usable by
+ * itself. Returns false if none can be combined. Uses the GNU "\|" operator.
+ */
+bool alternation(const std::vector<std::string> &sources, const std::vector<bool> &usable,
+	std::string &combined, std::vector<int> &groups);
+
+/*
+ * Bounded LRU cache of compiled patterns, keyed on the expanded pattern text.
+ * References returned by get() remain valid until the next call.
+ */
+class PatternCache {
+    typedef std::list<Pattern *> Entries;
+    typedef std::pair<std::string, int> Key;
+    Entries entries; // most recently used first.
+    std::map<Key, Entries::iterator> index;
+    size_t maxEntries;
+    PatternCache(const PatternCache &);
+    PatternCache &operator = (const PatternCache &);
+public:
+    PatternCache(size_t maxEntries = 64);
+    ~PatternCache();
+    const Pattern &get(const std::string &source, int flags = 0);
+};
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Ring buffer with a contiguous view of its contents.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "ringbuffer.h"
+
+static int
+anonymousFile()
+{
+#ifdef __linux__
+    return memfd_create("xmlexpect-ring", MFD_CLOEXEC);
+#else
+    return shm_open(SHM_ANON, O_RDWR, 0600);
+#endif
+}
+
+size_t
+RingBuffer::roundedSize(size_t minSize)
+{
+    static size_t page = sysconf(_SC_PAGESIZE);
+    return (minSize + page - 1) / page * page;
+}
+
+RingBuffer::RingBuffer(size_t minSize)
+{
+    len = roundedSize(minSize);
+
+    int fd = anonymousFile();
+    if (fd == -1)
+	throw UnixException(errno, "create ring buffer");
+    if (ftruncate(fd, len) == -1) {
+	int err = errno;
+	close(fd);
+	throw UnixException(err, "ftruncate");
+    }
+
+    // Reserve address space for both views, then map the file over each half.
+    void *addr = mmap(0, len * 2, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (addr == MAP_FAILED) {
+	int err = errno;
+	close(fd);
+	throw UnixException(err, "mmap");
+    }
+    base = (char *)addr;
+    for (int half = 0; half < 2; half++) {
+	if (mmap(base + half * len, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+	    int err = errno;
+	    munmap(base, len * 2);
+	    close(fd);
+	    throw UnixException(err, "mmap");
+	}
+    }
+    close(fd); // the mappings keep the memory alive.
+}
+
+RingBuffer::~RingBuffer()
+{
+    munmap(base, len * 2);
+}
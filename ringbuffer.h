@@ -0,0 +1,29 @@
+/*
+ * Ring buffer with a contiguous view of its contents.
+ */
+
+#ifndef ringbuffer_h_guard
+#define ringbuffer_h_guard
+
+#include <stddef.h>
+
+/*
+ * The buffer's pages are mapped twice, back to back, so size() bytes
+ * starting at any offset in the ring can be addressed as one array. A reader
+ * can therefore "move" data to the front of the buffer by moving its notion
+ * of where the front is, rather than copying.
+ */
+class RingBuffer {
+    char *base;
+    size_t len;
+    RingBuffer(const RingBuffer &);
+    RingBuffer &operator = (const RingBuffer &);
+public:
+    RingBuffer(size_t minSize); // rounded up to a whole number of pages...
+    static size_t roundedSize(size_t minSize); // ... like this.
+    ~RingBuffer();
+    size_t size() const { return len; }
+    char *at(size_t offset) const { return base + offset % len; }
+};
+
+#endif
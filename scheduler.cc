@@ -0,0 +1,403 @@
+/*
+ * Run many expect programs in one thread.
+ *
+ * Each session runs ExpectProgram::run on a stack of its own. It's started
+ * with setcontext, and from then on switched to and from with _setjmp and
+ * _longjmp, which unlike swapcontext leave the signal mask alone and so
+ * cost no system call. Every wait in the program goes through
+ * ExpectSession::wait, which is the only place a session gives up the thread.
+ */
+
+// The fortified _longjmp refuses to jump to another stack.
+#undef _FORTIFY_SOURCE
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <iostream>
+
+#include "scheduler.h"
+
+static unsigned sessionIds;
+
+static uint64_t
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+ExpectSession::ExpectSession(Scheduler &scheduler_, const ExpectNode *code_, int maxBuf,
+	std::map<std::string, std::string> &variables, int readFd, int writeFd)
+    : ExpectProgram(maxBuf, variables)
+    , scheduler(scheduler_)
+    , code(code_)
+    , initialRead(readFd)
+    , initialWrite(writeFd)
+    , stackSize(scheduler_.stackSize)
+    , started(false)
+    , finished(false)
+    , ready(0)
+    , timed(false)
+    , id(__sync_add_and_fetch(&sessionIds, 1))
+{
+    // Leave the lowest page unmapped, so running off the stack faults.
+    size_t page = sysconf(_SC_PAGESIZE);
+    stackSize = (stackSize + page - 1) / page * page + page;
+    void *addr = mmap(0, stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (addr == MAP_FAILED)
+	throw UnixException(errno, "mmap");
+    stack = (char *)addr;
+    mprotect(stack, page, PROT_NONE);
+
+    getcontext(&context);
+    context.uc_stack.ss_sp = stack;
+    context.uc_stack.ss_size = stackSize;
+    context.uc_link = 0; // start() never returns.
+    uintptr_t self = (uintptr_t)this;
+    makecontext(&context, (void (*)())start, 2, unsigned(self >> 16 >> 16), unsigned(self));
+}
+
+ExpectSession::~ExpectSession()
+{
+    // Output still queued by an unfinished session is dropped, rather than
+    // flushed from outside the session by ExpectProgram's destructor.
+    if (!finished) {
+	sendQueue.clear();
+	sendQueued = sendMark = 0;
+    }
+    munmap(stack, stackSize);
+}
+
+/*
+ * Something other than an Exception that ended a session, so done() can
+ * record it like any other failure.
+ */
+class SessionFailure : public Exception {
+    std::string reason;
+public:
+    SessionFailure(const std::string &reason_) : reason(reason_) {}
+    std::ostream &describe(std::ostream &os) const { return os << reason; }
+    ~SessionFailure() throw() {}
+};
+
+/*
+ * The bottom of a session's stack. Nothing may be thrown past here, and it
+ * leaves by jumping back to the scheduler for good.
+ */
+void
+ExpectSession::start(unsigned hi, unsigned lo)
+{
+    ExpectSession *session = (ExpectSession *)((uintptr_t)hi << 16 << 16 | lo);
+    bool ok = false;
+    try {
+	session->run(session->code, session->initialRead, session->initialWrite);
+	ok = true;
+    }
+    catch (const Exception &ex) {
+	session->done(&ex);
+    }
+    catch (const std::exception &ex) {
+	SessionFailure failure(ex.what());
+	session->done(&failure);
+    }
+    catch (...) {
+	SessionFailure failure("unknown exception");
+	session->done(&failure);
+    }
+    if (ok)
+	session->done(0); // outside the try, so a session is never recorded twice.
+    session->finished = true;
+    _longjmp(session->scheduler.main, 1);
+}
+
+void
+ExpectSession::done(const Exception *error)
+{
+    if (error)
+	LogLine(*this).stream() << "session " << id << ": ERROR: " << *error;
+    else
+	LogLine(*this).stream() << "session " << id << ": completed";
+}
+
+int
+ExpectSession::wait(int fd, short events, int msec)
+{
+    if (msec == 0)
+	return Waiter::wait(fd, events, 0); // just looking.
+    if (!scheduler.ring)
+	return scheduler.suspend(this, fd, events, msec);
+
+    io_uring_sqe *sqe = scheduler.ring->get(2);
+    if (fd == -1) {
+	ringTimeout.tv_sec = msec / 1000;
+	ringTimeout.tv_nsec = msec % 1000 * 1000000LL;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uintptr_t)&ringTimeout;
+	sqe->len = 1;
+	scheduler.perform(this, sqe, -1);
+	return 0;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    int rc = scheduler.perform(this, sqe, msec);
+    if (rc == -ECANCELED)
+	return 0;
+    if (rc < 0)
+	throw UnixException(-rc, "poll");
+    return 1;
+}
+
+ssize_t
+ExpectSession::readSome(int fd, char *data, size_t len, int msec)
+{
+    if (!scheduler.ring)
+	return Waiter::readSome(fd, data, len, msec);
+    if (msec == 0)
+	return ::read(fd, data, len); // connections are non-blocking.
+
+    io_uring_sqe *sqe = scheduler.ring->get(2);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = len;
+    sqe->off = (__u64)-1; // the current position, for pipes and ttys.
+    int rc = scheduler.perform(this, sqe, msec);
+    if (rc >= 0)
+	return rc;
+    errno = rc == -ECANCELED ? ETIMEDOUT : -rc;
+    return -1;
+}
+
+ssize_t
+ExpectSession::writeSome(int fd, const iovec *iov, int count, int msec)
+{
+    if (!scheduler.ring)
+	return Waiter::writeSome(fd, iov, count, msec);
+
+    io_uring_sqe *sqe = scheduler.ring->get(2);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = count;
+    sqe->off = (__u64)-1;
+    int rc = scheduler.perform(this, sqe, msec);
+    if (rc >= 0)
+	return rc;
+    errno = rc == -ECANCELED ? ETIMEDOUT : -rc;
+    return -1;
+}
+
+Scheduler::Scheduler(bool uring, size_t stackSize_)
+    : ring(0)
+    , stackSize(stackSize_)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+	throw UnixException(errno, "epoll_create");
+    if (uring) {
+	try {
+	    ring = new Uring(1024);
+	}
+	catch (const UnixException &ex) {
+	    std::clog << "io_uring unavailable (" << ex << "), using epoll" << std::endl;
+	}
+    }
+}
+
+/*
+ * Sessions still unfinished, if run() was abandoned by an exception, are
+ * deleted wherever they were waiting. The ring goes first, so the kernel
+ * cancels their requests before their buffers go.
+ */
+Scheduler::~Scheduler()
+{
+    delete ring;
+    for (std::set<ExpectSession *>::iterator i = sessions.begin(); i != sessions.end(); ++i)
+	delete *i;
+    close(epfd);
+}
+
+void
+Scheduler::add(ExpectSession *session)
+{
+    runnable.push_back(session);
+    sessions.insert(session);
+}
+
+void
+Scheduler::resume(ExpectSession *session)
+{
+    if (_setjmp(main) == 0) {
+	if (session->started)
+	    _longjmp(session->jump, 1);
+	session->started = true;
+	setcontext(&session->context);
+    }
+    if (session->finished) {
+	sessions.erase(session);
+	delete session;
+    }
+}
+
+// Called on the session's stack: switch back to the scheduler's loop.
+void
+Scheduler::yield(ExpectSession *session)
+{
+    if (_setjmp(session->jump) == 0)
+	_longjmp(main, 1);
+}
+
+/*
+ * Called on the session's stack: arrange to be woken, then switch back to
+ * the scheduler's loop until we are.
+ */
+int
+Scheduler::suspend(ExpectSession *session, int fd, short events, int msec)
+{
+    if (fd != -1) {
+	epoll_event ev;
+	ev.events = EPOLLONESHOT;
+	if (events & POLLIN)
+	    ev.events |= EPOLLIN;
+	if (events & POLLPRI)
+	    ev.events |= EPOLLPRI;
+	if (events & POLLOUT)
+	    ev.events |= EPOLLOUT;
+	ev.data.ptr = session;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	    if (errno == EPERM)
+		return 1; // a regular file, which is always ready.
+	    throw UnixException(errno, "epoll_ctl");
+	}
+    }
+    if (msec > 0) {
+	session->timer = timers.insert(std::make_pair(now() + msec, session));
+	session->timed = true;
+    }
+    session->ready = 0;
+    yield(session);
+
+    if (session->timed) {
+	timers.erase(session->timer);
+	session->timed = false;
+    }
+    if (fd != -1)
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+    return session->ready;
+}
+
+/*
+ * Called on the session's stack with a request filled in, from get(2) so
+ * there's room after it for a linked timeout: add the timeout if needed,
+ * and switch back to the scheduler's loop until the request is done.
+ * Returns the request's result, which is -ECANCELED if it timed out.
+ */
+int
+Scheduler::perform(ExpectSession *session, io_uring_sqe *sqe, int msec)
+{
+    sqe->user_data = (uintptr_t)session;
+    if (msec > 0) {
+	sqe->flags |= IOSQE_IO_LINK;
+	session->ringTimeout.tv_sec = msec / 1000;
+	session->ringTimeout.tv_nsec = msec % 1000 * 1000000LL;
+	io_uring_sqe *link = ring->get();
+	link->opcode = IORING_OP_LINK_TIMEOUT;
+	link->addr = (uintptr_t)&session->ringTimeout;
+	link->len = 1;
+	link->user_data = 0; // its completion is of no interest.
+    }
+    yield(session);
+    return session->ready;
+}
+
+SessionSource::~SessionSource()
+{
+}
+
+/*
+ * Sessions from the source are started a few at a time, without blocking
+ * in between, so a scheduler busy with its own sessions takes fewer new
+ * ones and leaves the rest to other threads' schedulers.
+ */
+void
+Scheduler::run(SessionSource *source)
+{
+    epoll_event events[256];
+
+    while (!sessions.empty() || source) {
+	int sourceWait = 0;
+	for (int i = 0; source && i < 16; i++) {
+	    ExpectSession *session = source->next(*this, sourceWait);
+	    if (session) {
+		add(session);
+	    } else {
+		if (sourceWait < 0)
+		    source = 0;
+		break;
+	    }
+	}
+	while (!runnable.empty()) {
+	    ExpectSession *session = runnable.front();
+	    runnable.pop_front();
+	    resume(session);
+	}
+	if (sessions.empty() && sourceWait <= 0)
+	    continue;
+
+	if (ring) {
+	    if (source && sourceWait > 0) {
+		// Wake for the source, or for the first completion, whichever comes first.
+		sourceTimeout.tv_sec = sourceWait / 1000;
+		sourceTimeout.tv_nsec = sourceWait % 1000 * 1000000LL;
+		io_uring_sqe *sqe = ring->get();
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t)&sourceTimeout;
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = 0;
+	    }
+	    ring->submit(source && sourceWait == 0 ? 0 : 1);
+	    io_uring_cqe cqe;
+	    while (ring->next(cqe)) {
+		if (cqe.user_data == 0)
+		    continue;
+		ExpectSession *session = (ExpectSession *)cqe.user_data;
+		session->ready = cqe.res;
+		resume(session);
+	    }
+	    continue;
+	}
+
+	int msec = source ? sourceWait : -1;
+	if (!timers.empty()) {
+	    uint64_t t = now();
+	    int due = timers.begin()->first > t ? timers.begin()->first - t : 0;
+	    if (msec == -1 || due < msec)
+		msec = due;
+	}
+	int count = epoll_wait(epfd, events, sizeof events / sizeof events[0], msec);
+	if (count == -1) {
+	    if (errno == EINTR)
+		continue;
+	    throw UnixException(errno, "epoll_wait");
+	}
+	for (int i = 0; i < count; i++) {
+	    ExpectSession *session = (ExpectSession *)events[i].data.ptr;
+	    session->ready = 1;
+	    resume(session);
+	}
+	for (uint64_t t = now(); !timers.empty() && timers.begin()->first <= t; ) {
+	    ExpectSession *session = timers.begin()->second;
+	    timers.erase(timers.begin());
+	    session->timed = false;
+	    resume(session);
+	}
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * Run many expect programs in one thread.
+ */
+
+#ifndef scheduler_h_guard
+#define scheduler_h_guard
+
+#include <setjmp.h>
+#include <ucontext.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+#include "xmlexpect.h"
+#include "uring.h"
+
+class Scheduler;
+
+/*
+ * An ExpectProgram with its own stack. Whenever it would wait for a file
+ * descriptor or a timeout, it hands the thread back to its scheduler, which
+ * resumes it when the descriptor is ready or the time is up. The parsed
+ * script is only read, so any number of sessions can share one.
+ */
+class ExpectSession : public ExpectProgram {
+    friend class Scheduler;
+protected:
+    Scheduler &scheduler;
+private:
+    const ExpectNode *code;
+    int initialRead;
+    int initialWrite;
+    ucontext_t context; // to start it...
+    jmp_buf jump; // ... and to resume it once it has.
+    char *stack;
+    size_t stackSize;
+    bool started;
+    bool finished;
+    int ready; // what wait() returns, once resumed.
+    bool timed;
+    std::multimap<uint64_t, ExpectSession *>::iterator timer;
+    __kernel_timespec ringTimeout; // for io_uring timeouts.
+    static void start(unsigned hi, unsigned lo);
+public:
+    const unsigned id;
+    ExpectSession(Scheduler &, const ExpectNode *code, int maxBuf,
+	    std::map<std::string, std::string> &variables, int readFd = -1, int writeFd = -1);
+    ~ExpectSession();
+    int wait(int fd, short events, int msec);
+    ssize_t readSome(int fd, char *data, size_t len, int msec);
+    ssize_t writeSome(int fd, const iovec *iov, int count, int msec);
+    virtual void done(const Exception *error); // called as the session finishes.
+};
+
+/*
+ * Hands out sessions to a scheduler as it has time to start them.
+ */
+class SessionSource {
+public:
+    // Null if there's nothing to start yet: "wait" is then the msec until
+    // there may be, or -1 if there will never be another.
+    virtual ExpectSession *next(Scheduler &, int &wait) = 0;
+    virtual ~SessionSource();
+};
+
+/*
+ * Resumes sessions as the descriptors they wait on become ready, using
+ * epoll, or as their timeouts expire. With io_uring, sessions' reads and
+ * writes go to the kernel as requests instead, all submitted together
+ * once every runnable session has had its turn.
+ */
+class Scheduler {
+    friend class ExpectSession;
+    int epfd;
+    Uring *ring; // null to use epoll.
+    jmp_buf main;
+    std::list<ExpectSession *> runnable;
+    std::multimap<uint64_t, ExpectSession *> timers; // by deadline, in msec.
+    std::set<ExpectSession *> sessions; // every one not yet finished, wherever it's waiting.
+    size_t stackSize;
+    __kernel_timespec sourceTimeout; // for io_uring, while waiting on a SessionSource.
+    void resume(ExpectSession *);
+    void yield(ExpectSession *);
+    int suspend(ExpectSession *, int fd, short events, int msec);
+    int perform(ExpectSession *, io_uring_sqe *, int msec);
+    Scheduler(const Scheduler &);
+    Scheduler &operator = (const Scheduler &);
+public:
+    Scheduler(bool uring = false, size_t stackSize = 256 * 1024); // falls back to epoll without io_uring.
+    ~Scheduler();
+    void add(ExpectSession *); // the scheduler deletes it when it's finished.
+    void run(SessionSource *source = 0); // until every session has finished.
+};
+
+#endif
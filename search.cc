@@ -0,0 +1,210 @@
+/*
+ * Fast substring search.
+ *
+ * The vector versions compare the first and last bytes of the needle against
+ * a block of candidate positions at once, and only check the full needle where
+ * both agree. Which one we use is decided once, from what the CPU supports.
+ */
+
+#include <string.h>
+
+#include "search.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+typedef const char *(*Finder)(const char *, size_t, const char *, size_t, bool);
+typedef const char *(*ByteFinder)(const char *, size_t, char, char);
+
+static inline char
+otherCase(char c)
+{
+    if (c >= 'a' && c <= 'z')
+	return c - 'a' + 'A';
+    if (c >= 'A' && c <= 'Z')
+	return c - 'A' + 'a';
+    return c;
+}
+
+static inline char
+lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static inline bool
+same(const char *p, const char *needle, size_t nlen, bool nocase)
+{
+    if (!nocase)
+	return memcmp(p, needle, nlen) == 0;
+    for (size_t i = 0; i < nlen; i++)
+	if (lower(p[i]) != lower(needle[i]))
+	    return false;
+    return true;
+}
+
+static const char *
+findScalar(const char *haystack, size_t len, const char *needle, size_t nlen, bool nocase)
+{
+    if (nlen > len)
+	return 0;
+    if (!nocase)
+	return (const char *)memmem(haystack, len, needle, nlen);
+    char first = lower(needle[0]);
+    for (size_t i = 0; i <= len - nlen; i++)
+	if (lower(haystack[i]) == first && same(haystack + i, needle, nlen, true))
+	    return haystack + i;
+    return 0;
+}
+
+static const char *
+eitherScalar(const char *haystack, size_t len, char a, char b)
+{
+    for (size_t i = 0; i < len; i++)
+	if (haystack[i] == a || haystack[i] == b)
+	    return haystack + i;
+    return 0;
+}
+
+#ifdef SEARCH_X86
+
+__attribute__((target("sse2")))
+static const char *
+eitherSSE2(const char *haystack, size_t len, char a, char b)
+{
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(haystack + i));
+	unsigned bits = _mm_movemask_epi8(
+		_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+	if (bits)
+	    return haystack + i + __builtin_ctz(bits);
+    }
+    return eitherScalar(haystack + i, len - i, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char *
+eitherAVX2(const char *haystack, size_t len, char a, char b)
+{
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(haystack + i));
+	unsigned bits = _mm256_movemask_epi8(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+	if (bits)
+	    return haystack + i + __builtin_ctz(bits);
+    }
+    return eitherSSE2(haystack + i, len - i, a, b);
+}
+
+__attribute__((target("sse2")))
+static const char *
+findSSE2(const char *haystack, size_t len, const char *needle, size_t nlen, bool nocase)
+{
+    if (nlen > len)
+	return 0;
+    char first = needle[0], last = needle[nlen - 1];
+    const __m128i f0 = _mm_set1_epi8(first);
+    const __m128i f1 = _mm_set1_epi8(nocase ? otherCase(first) : first);
+    const __m128i l0 = _mm_set1_epi8(last);
+    const __m128i l1 = _mm_set1_epi8(nocase ? otherCase(last) : last);
+    size_t starts = len - nlen + 1, i;
+
+    for (i = 0; i + 16 <= starts; i += 16) {
+	__m128i a = _mm_loadu_si128((const __m128i *)(haystack + i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(haystack + i + nlen - 1));
+	__m128i hits = _mm_and_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1)),
+		_mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1)));
+	for (unsigned bits = _mm_movemask_epi8(hits); bits; bits &= bits - 1) {
+	    const char *p = haystack + i + __builtin_ctz(bits);
+	    if (same(p, needle, nlen, nocase))
+		return p;
+	}
+    }
+    return findScalar(haystack + i, len - i, needle, nlen, nocase);
+}
+
+__attribute__((target("avx2")))
+static const char *
+findAVX2(const char *haystack, size_t len, const char *needle, size_t nlen, bool nocase)
+{
+    if (nlen > len)
+	return 0;
+    char first = needle[0], last = needle[nlen - 1];
+    const __m256i f0 = _mm256_set1_epi8(first);
+    const __m256i f1 = _mm256_set1_epi8(nocase ? otherCase(first) : first);
+    const __m256i l0 = _mm256_set1_epi8(last);
+    const __m256i l1 = _mm256_set1_epi8(nocase ? otherCase(last) : last);
+    size_t starts = len - nlen + 1, i;
+
+    for (i = 0; i + 32 <= starts; i += 32) {
+	__m256i a = _mm256_loadu_si256((const __m256i *)(haystack + i));
+	__m256i b = _mm256_loadu_si256((const __m256i *)(haystack + i + nlen - 1));
+	__m256i hits = _mm256_and_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(a, f0), _mm256_cmpeq_epi8(a, f1)),
+		_mm256_or_si256(_mm256_cmpeq_epi8(b, l0), _mm256_cmpeq_epi8(b, l1)));
+	for (unsigned bits = _mm256_movemask_epi8(hits); bits; bits &= bits - 1) {
+	    const char *p = haystack + i + __builtin_ctz(bits);
+	    if (same(p, needle, nlen, nocase))
+		return p;
+	}
+    }
+    return findSSE2(haystack + i, len - i, needle, nlen, nocase);
+}
+
+#endif
+
+static Finder
+chooseFinder()
+{
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return findAVX2;
+    if (__builtin_cpu_supports("sse2"))
+	return findSSE2;
+#endif
+    return findScalar;
+}
+
+static ByteFinder
+chooseByteFinder()
+{
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return eitherAVX2;
+    if (__builtin_cpu_supports("sse2"))
+	return eitherSSE2;
+#endif
+    return eitherScalar;
+}
+
+static const Finder finder = chooseFinder();
+static const ByteFinder byteFinder = chooseByteFinder();
+
+const char *
+findLiteral(const char *haystack, size_t len, const char *needle, size_t nlen, bool nocase)
+{
+    if (nlen == 0)
+	return haystack;
+    return finder(haystack, len, needle, nlen, nocase);
+}
+
+const char *
+findEither(const char *haystack, size_t len, char a, char b)
+{
+    if (a == b)
+	return (const char *)memchr(haystack, a, len);
+    return byteFinder(haystack, len, a, b);
+}
@@ -0,0 +1,16 @@
+/*
+ * Fast substring search for patterns that need no regular expression engine.
+ */
+
+#ifndef search_h_guard
+#define search_h_guard
+
+#include <stddef.h>
+
+// Find the first occurrence of needle in haystack, or null if there is none.
+const char *findLiteral(const char *haystack, size_t len, const char *needle, size_t nlen, bool nocase);
+
+// Find the first byte that is either a or b, or null if there is none.
+const char *findEither(const char *haystack, size_t len, char a, char b);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Binary trace of what's sent and received.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "trace.h"
+
+static uint32_t sessions;
+
+Trace::Trace(TraceFile &file_, size_t size)
+    : file(file_)
+    , ring(size)
+    , head(0)
+    , tail(0)
+    , dropped(0)
+    , session(__sync_add_and_fetch(&sessions, 1))
+{
+    pthread_mutex_lock(&file.lock);
+    file.traces.push_back(this);
+    pthread_mutex_unlock(&file.lock);
+}
+
+Trace::~Trace()
+{
+    pthread_mutex_lock(&file.lock);
+    drain(file.out);
+    file.traces.remove(this);
+    pthread_mutex_unlock(&file.lock);
+}
+
+/*
+ * Copy a record into the ring, if there's room. The mirrored mapping means a
+ * record never has to be split at the end of the ring.
+ */
+bool
+Trace::put(TraceKind kind, const iovec *iov, int count)
+{
+    TraceRecord rec;
+    size_t len = 0;
+    for (int i = 0; i < count; i++)
+	len += iov[i].iov_len;
+    size_t used = head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if (sizeof rec + len > ring.size() - used)
+	return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&rec, 0, sizeof rec);
+    rec.time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    rec.session = session;
+    rec.length = len;
+    rec.kind = kind;
+    char *p = ring.at(head);
+    memcpy(p, &rec, sizeof rec);
+    p += sizeof rec;
+    for (int i = 0; i < count; i++) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	p += iov[i].iov_len;
+    }
+    __atomic_store_n(&head, head + sizeof rec + len, __ATOMIC_RELEASE);
+    return true;
+}
+
+void
+Trace::record(TraceKind kind, const iovec *iov, int count)
+{
+    if (dropped != 0) {
+	iovec v;
+	v.iov_base = &dropped;
+	v.iov_len = sizeof dropped;
+	if (!put(TraceDropped, &v, 1)) {
+	    dropped++;
+	    return;
+	}
+	dropped = 0;
+    }
+    if (!put(kind, iov, count))
+	dropped++;
+}
+
+void
+Trace::record(TraceKind kind, const char *data, size_t len)
+{
+    iovec v;
+    v.iov_base = const_cast<char *>(data);
+    v.iov_len = len;
+    record(kind, &v, 1);
+}
+
+/*
+ * Write out whatever the session has recorded. Called with the file locked.
+ */
+void
+Trace::drain(FILE *out)
+{
+    size_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    if (end == tail)
+	return;
+    fwrite(ring.at(tail), 1, end - tail, out);
+    __atomic_store_n(&tail, end, __ATOMIC_RELEASE);
+}
+
+TraceFile::TraceFile(const std::string &name)
+    : stopping(false)
+{
+    out = fopen(name.c_str(), "wb");
+    if (out == 0)
+	throw FileOpenException(name, errno);
+    fwrite(traceMagic, 1, sizeof traceMagic, out);
+    fwrite(&traceByteOrder, 1, sizeof traceByteOrder, out);
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&wake, 0);
+    int rc = pthread_create(&writer, 0, run, this);
+    if (rc != 0) {
+	fclose(out);
+	throw UnixException(rc, "pthread_create");
+    }
+}
+
+TraceFile::~TraceFile()
+{
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, 0);
+    drainAll();
+    fclose(out);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+TraceFile::drainAll()
+{
+    pthread_mutex_lock(&lock);
+    for (std::list<Trace *>::iterator i = traces.begin(); i != traces.end(); ++i)
+	(*i)->drain(out);
+    fflush(out);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The writer thread: empty every session's ring every few milliseconds.
+ */
+void *
+TraceFile::run(void *arg)
+{
+    TraceFile *file = (TraceFile *)arg;
+    for (;;) {
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += 10 * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&file->lock);
+	if (!file->stopping)
+	    pthread_cond_timedwait(&file->wake, &file->lock, &until);
+	bool done = file->stopping;
+	pthread_mutex_unlock(&file->lock);
+	file->drainAll();
+	if (done)
+	    return 0;
+    }
+}
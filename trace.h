@@ -0,0 +1,89 @@
+/*
+ * Binary trace of what's sent and received, for when logging text to
+ * std::clog costs more than the dialog itself. See tracedump for reading it.
+ */
+
+#ifndef trace_h_guard
+#define trace_h_guard
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <list>
+#include <string>
+
+#include "ringbuffer.h"
+
+enum TraceKind {
+    TraceSend = 1,
+    TraceReceive,
+    TraceEvent, // free text.
+    TraceDropped // records lost because the ring was full; data is a uint64_t count.
+};
+
+/*
+ * The file starts with traceMagic and traceByteOrder, and is followed by
+ * records, each one a header and then "length" bytes of data.
+ */
+static const char traceMagic[8] = { 'x', 'e', 't', 'r', 'a', 'c', 'e', '1' };
+const uint32_t traceByteOrder = 0x01020304;
+
+struct TraceRecord {
+    uint64_t time; // nsec since the epoch.
+    uint32_t session;
+    uint32_t length;
+    uint8_t kind;
+    uint8_t reserved[7];
+};
+
+class TraceFile;
+
+/*
+ * A session's records, on their way to a TraceFile. Only the session writes
+ * to the ring and only the file's writer thread reads from it, so neither
+ * needs a lock. If the writer falls behind, records are dropped (and counted)
+ * rather than holding up the session.
+ */
+class Trace {
+    friend class TraceFile;
+    TraceFile &file;
+    RingBuffer ring;
+    size_t head; // total bytes written to the ring...
+    size_t tail; // ... and read from it.
+    uint64_t dropped;
+    bool put(TraceKind kind, const iovec *iov, int count);
+    void drain(FILE *out);
+    Trace(const Trace &);
+    Trace &operator = (const Trace &);
+public:
+    const uint32_t session;
+    Trace(TraceFile &file, size_t size = 1 << 20);
+    TraceFile &traceFile() const { return file; }
+    ~Trace();
+    void record(TraceKind kind, const iovec *iov, int count);
+    void record(TraceKind kind, const char *data, size_t len);
+};
+
+/*
+ * The file, and a thread that copies records from each session's ring to it.
+ */
+class TraceFile {
+    friend class Trace;
+    FILE *out;
+    pthread_t writer;
+    pthread_mutex_t lock; // protects traces and stopping.
+    pthread_cond_t wake;
+    std::list<Trace *> traces;
+    bool stopping;
+    static void *run(void *);
+    void drainAll();
+    TraceFile(const TraceFile &);
+    TraceFile &operator = (const TraceFile &);
+public:
+    TraceFile(const std::string &name);
+    ~TraceFile();
+};
+
+#endif
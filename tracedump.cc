@@ -0,0 +1,90 @@
+/*
+ * Print a binary trace written by xmlexpect -t as a readable transcript.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <vector>
+
+#include "util.h"
+#include "trace.h"
+
+static const char *
+kindName(int kind)
+{
+    switch (kind) {
+    case TraceSend: return "SEND";
+    case TraceReceive: return "RECV";
+    case TraceEvent: return "EVENT";
+    case TraceDropped: return "DROPPED";
+    default: return "(unknown)";
+    }
+}
+
+static int
+dump(const char *name, FILE *in)
+{
+    char magic[sizeof traceMagic];
+    uint32_t order;
+    if (fread(magic, 1, sizeof magic, in) != sizeof magic
+	    || memcmp(magic, traceMagic, sizeof magic) != 0
+	    || fread(&order, 1, sizeof order, in) != sizeof order) {
+	std::clog << name << ": not a trace file" << std::endl;
+	return -1;
+    }
+    if (order != traceByteOrder) {
+	std::clog << name << ": trace was written with a different byte order" << std::endl;
+	return -1;
+    }
+
+    TraceRecord rec;
+    std::vector<char> data;
+    while (fread(&rec, 1, sizeof rec, in) == sizeof rec) {
+	data.resize(rec.length);
+	if (rec.length && fread(&data[0], 1, rec.length, in) != rec.length) {
+	    std::clog << name << ": truncated record" << std::endl;
+	    return -1;
+	}
+	time_t secs = rec.time / 1000000000;
+	struct tm tm;
+	char when[32];
+	strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+	printf("%s.%06u %u %s ", when, unsigned(rec.time % 1000000000 / 1000),
+		unsigned(rec.session), kindName(rec.kind));
+	if (rec.kind == TraceDropped && rec.length == sizeof(uint64_t)) {
+	    uint64_t count;
+	    memcpy(&count, &data[0], sizeof count);
+	    printf("%llu records\n", (unsigned long long)count);
+	} else if (rec.kind == TraceEvent) {
+	    printf("%.*s\n", int(rec.length), rec.length ? &data[0] : "");
+	} else {
+	    printf("%s\n", printableString(rec.length ? &data[0] : "", rec.length).c_str());
+	}
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2) {
+	std::clog << "tracedump <file> ..." << std::endl;
+	return -1;
+    }
+    int rc = 0;
+    for (int i = 1; i < argc; i++) {
+	FILE *in = fopen(argv[i], "rb");
+	if (in == 0) {
+	    std::clog << FileOpenException(argv[i], errno) << std::endl;
+	    rc = -1;
+	    continue;
+	}
+	if (dump(argv[i], in) != 0)
+	    rc = -1;
+	fclose(in);
+    }
+    return rc;
+}
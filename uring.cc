@@ -0,0 +1,146 @@
+/*
+ * Minimal io_uring wrapper, talking to the kernel directly.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "util.h"
+#include "uring.h"
+
+Uring::Uring(unsigned entries)
+    : queued(0)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1)
+	throw UnixException(errno, "io_uring_setup");
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+	sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    void *sq = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+	cq = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *entry = MAP_FAILED;
+    if (cq != MAP_FAILED)
+	entry = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (entry == MAP_FAILED) {
+	int err = errno;
+	if (cq != MAP_FAILED && cq != sq)
+	    munmap(cq, cqRingSize);
+	if (sq != MAP_FAILED)
+	    munmap(sq, sqRingSize);
+	close(fd);
+	throw UnixException(err, "mmap");
+    }
+    sqRing = (char *)sq;
+    cqRing = (char *)cq;
+    sqes = (io_uring_sqe *)entry;
+
+    sqHead = (unsigned *)(sqRing + params.sq_off.head);
+    sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+    sqMask = (unsigned *)(sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sqRing + params.sq_off.array);
+    cqHead = (unsigned *)(cqRing + params.cq_off.head);
+    cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+    cqMask = (unsigned *)(cqRing + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cqRing + params.cq_off.cqes);
+}
+
+Uring::~Uring()
+{
+    munmap(sqes, sqesSize);
+    if (cqRing != sqRing)
+	munmap(cqRing, cqRingSize);
+    munmap(sqRing, sqRingSize);
+    close(fd);
+}
+
+io_uring_sqe *
+Uring::get(unsigned room)
+{
+    // Make room now, if needed: a submit between linked entries would
+    // separate them. The kernel may take only some of what's queued, or
+    // none while it has completions it can't post, so keep at it, putting
+    // completions aside, until there's room for all of them.
+    while (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) + room > *sqMask + 1) {
+	unsigned before = queued;
+	submit(0);
+	if (queued == before)
+	    reap();
+    }
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return sqe;
+}
+
+void
+Uring::submit(unsigned wait)
+{
+    if (!reaped.empty())
+	wait = 0; // there are completions already.
+    for (;;) {
+	int rc = syscall(__NR_io_uring_enter, fd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+	if (rc >= 0) {
+	    queued -= std::min<unsigned>(rc, queued);
+	    if (queued == 0 || wait == 0)
+		return;
+	    continue;
+	}
+	if (errno == EINTR)
+	    continue;
+	if (errno == EBUSY && wait == 0)
+	    return; // completions to reap first; the caller will get to them.
+	throw UnixException(errno, "io_uring_enter");
+    }
+}
+
+/*
+ * Move completions off the ring, so the kernel can post more, to be
+ * handed out by next() later.
+ */
+void
+Uring::reap()
+{
+    io_uring_cqe cqe;
+    while (take(cqe))
+	reaped.push_back(cqe);
+}
+
+bool
+Uring::next(io_uring_cqe &cqe)
+{
+    if (!reaped.empty()) {
+	cqe = reaped.front();
+	reaped.pop_front();
+	return true;
+    }
+    return take(cqe);
+}
+
+bool
+Uring::take(io_uring_cqe &cqe)
+{
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+	return false;
+    cqe = cqes[head & *cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,40 @@
+/*
+ * Minimal io_uring wrapper, talking to the kernel directly.
+ */
+
+#ifndef uring_h_guard
+#define uring_h_guard
+
+#include <linux/io_uring.h>
+#include <deque>
+
+/*
+ * Requests are queued with get() and go to the kernel together on the next
+ * submit(), so one system call can carry the work of many sessions.
+ */
+class Uring {
+    int fd;
+    char *sqRing;
+    char *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+    unsigned queued; // entries filled in since the last submit.
+    std::deque<io_uring_cqe> reaped; // completions taken off the ring early.
+    void reap();
+    bool take(io_uring_cqe &cqe); // the next completion on the ring itself.
+    Uring(const Uring &);
+    Uring &operator = (const Uring &);
+public:
+    Uring(unsigned entries); // throws UnixException if io_uring isn't available.
+    ~Uring();
+    io_uring_sqe *get(unsigned room = 1); // a cleared entry, with room for room - 1 more in the same submission.
+    void submit(unsigned wait); // submit what's queued, and wait for that many completions.
+    bool next(io_uring_cqe &cqe); // take the next completion, if there is one.
+};
+
+#endif
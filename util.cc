@@ -5,6 +5,8 @@
 #include <pthread.h>
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <iostream>
 #include <string.h>
@@ -23,19 +25,74 @@ pad(int indent)
 std::string
 printableString(const char *data, int len)
 {
-    std::string s = "";
+    static const char hex[] = "0123456789abcdef";
+    std::string s;
+    s.reserve(len);
+
+    for (int i = 0; i < len; ) {
+	// Append runs of printable characters in one go.
+	int run = i;
+	while (run < len && data[run] >= 32 && data[run] < 0x7f)
+	    run++;
+	s.append(data + i, run - i);
+	if (run == len)
+	    break;
+	unsigned char c = data[run];
+	char buf[4] = { '<', hex[c >> 4], hex[c & 0xf], '>' };
+	s.append(buf, sizeof buf);
+	i = run + 1;
+    }
+    return s;
+}
+
+int
+Waiter::wait(int fd, short events, int msec)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    int rc;
+    while ((rc = poll(&pfd, fd == -1 ? 0 : 1, msec)) == -1)
+	if (errno != EINTR)
+	    throw UnixException(errno, "poll");
+    return rc;
+}
+
+ssize_t
+Waiter::readSome(int fd, char *data, size_t len, int msec)
+{
+    ssize_t rc;
+    do {
+	if (wait(fd, POLLIN|POLLPRI, msec) == 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+	rc = ::read(fd, data, len);
+    } while (rc == -1 && errno == EAGAIN);
+    return rc;
+}
 
-    for (int i = 0; i < len; i++) {
-	char c = data[i];
-	if (c >= 32 && c < 0x7f)  {
-	    s += c;
-	} else {
-	    char buf[5];
-	    snprintf(buf, 5, "<%2.2x>", c);
-	    s += buf;
+ssize_t
+Waiter::writeSome(int fd, const iovec *iov, int count, int msec)
+{
+    ssize_t rc;
+    while ((rc = ::writev(fd, iov, count)) == -1 && errno == EAGAIN) {
+	if (wait(fd, POLLOUT, msec) == 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
 	}
     }
-    return s;
+    return rc;
+}
+
+void
+Waiter::logEvent(const std::string &text)
+{
+    std::clog << text + "\n"; // one write, so lines from other threads don't interleave.
+}
+
+Waiter::~Waiter()
+{
 }
 
 Exception::Exception()
@@ -5,13 +5,41 @@
 #ifndef util_h_guard
 #define util_h_guard
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <exception>
 #include <iosfwd>
+#include <sstream>
 #include <string>
 
 const char *pad(int indent);
 std::string printableString(const char *data, int len);
 
+/*
+ * All waiting for file descriptors goes through a Waiter, so something
+ * running many sessions at once can switch to another session instead of
+ * blocking. The defaults use poll(2), read(2) and writev(2). readSome and
+ * writeSome fail with ETIMEDOUT if nothing can be done within msec. Code
+ * working on a session's behalf logs through it too.
+ */
+class Waiter {
+public:
+    virtual int wait(int fd, short events, int msec); // fd -1 just sleeps.
+    virtual ssize_t readSome(int fd, char *data, size_t len, int msec);
+    virtual ssize_t writeSome(int fd, const iovec *iov, int count, int msec);
+    virtual void logEvent(const std::string &text); // a line, to std::clog by default.
+    virtual ~Waiter();
+};
+
+// Collects a line to log, and logs it in one piece when it goes out of scope.
+class LogLine : public std::ostringstream {
+    Waiter &waiter;
+public:
+    LogLine(Waiter &waiter_) : waiter(waiter_) {}
+    ~LogLine() { waiter.logEvent(str()); }
+    std::ostream &stream() { return *this; }
+};
+
 class Exception : public std::exception {
 protected:
     virtual std::ostream &describe(std::ostream &) const = 0;
@@ -6,22 +6,34 @@
  * $Id: xmlExpect.cc,v 1.18 2004/08/29 11:36:03 petere Exp $
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <limits.h>
 #include <poll.h>
 #include <arpa/telnet.h>
 #include <regex.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <exception>
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <list>
 #include <map>
+#include <vector>
 #include <typeinfo>
 
 #include "xmlexpect.h"
 #include "connection.h"
+#include "listener.h"
 #include "util.h"
+#include "search.h"
 
 /*
  * Classes
@@ -38,9 +50,24 @@ class ExpectListen : public ExpectElement {
     ListenConnection net;
 public:
     virtual void execute(ExpectProgram &program) const;
+    bool persistent() const { return net.persistent; }
     ExpectListen(const char **);
 };
 
+class ExpectUnix : public ExpectElement {
+    UnixConnection net;
+public:
+    virtual void execute(ExpectProgram &program) const;
+    ExpectUnix(const char **);
+};
+
+class ExpectUnixListen : public ExpectElement {
+    UnixListenConnection net;
+public:
+    virtual void execute(ExpectProgram &program) const;
+    ExpectUnixListen(const char **);
+};
+
 class ExpectVariable : public ExpectCharacterData {
     std::string key;
     std::string def;
@@ -56,6 +83,12 @@ public:
     ExpectModem(const char **);
 };
 
+class ExpectRelease : public ExpectElement {
+public:
+    virtual void execute(ExpectProgram &program) const;
+    ExpectRelease(const char **) {}
+};
+
 class ExpectSleep : public ExpectElement {
     int delay;
 public:
@@ -64,7 +97,15 @@ public:
 };
 
 class ExpectSend : public ExpectElement {
+    struct Segment {
+	const char *data; // literal text, or...
+	int len;
+	const ExpectCharacterData *node; // ... a node to write at run time.
+    };
+    std::vector<Segment> segments;
+    std::list<std::string> joined; // runs of literal children, concatenated.
 public:
+    void complete();
     virtual void execute(ExpectProgram &program) const;
 };
 
@@ -78,7 +119,8 @@ public:
 };
 
 class ExpectDrip : public ExpectElement {
-     bool rate;
+    double rate; // bytes per second, or zero to send at full speed.
+    double burst;
 public:
     virtual void execute(ExpectProgram &program) const;
     ExpectDrip(const char **attributes);
@@ -98,9 +140,48 @@ public:
     ExpectTimeout(const char **attribs);
 };
 
+class ExpectQuiet : public ExpectElement {
+    int value;
+public:
+    virtual void execute(ExpectProgram &program) const;
+    ExpectQuiet(const char **attribs);
+};
+
+class ExpectTelnet : public ExpectElement {
+    bool setAccept;
+    bool accept[256];
+    int cols; // zero to leave unchanged.
+    int rows;
+public:
+    virtual void execute(ExpectProgram &program) const;
+    ExpectTelnet(const char **attribs);
+};
+
+class ExpectBuffer : public ExpectElement {
+    int receive; // zero to leave unchanged.
+    int send;
+    int limit;
+public:
+    virtual void execute(ExpectProgram &program) const;
+    ExpectBuffer(const char **attribs);
+};
+
+class ExpectExpect;
+
 class ExpectChoose : public ExpectControlElement {
+    std::vector<const ExpectExpect *> branches;
+    std::vector<const ExpectNode *> actions;
+    bool dynamic; // some branch depends on run-time values.
+    bool mixedCase; // some branches ignore case and some don't.
+    Pattern *combined; // all branches, if they could be compiled together.
+    std::vector<int> groups; // subexpression of combined for each branch; -1 if it's not in it.
+    int caseFlags() const;
+    int match(ExpectProgram &program) const;
+    int match(ExpectProgram &program, const Pattern *, const std::vector<int> &) const;
 public:
     ExpectChoose();
+    ~ExpectChoose();
+    void complete();
     virtual void execute(ExpectProgram &program) const;
 };
 
@@ -151,6 +232,7 @@ public:
     ExpectRawCharacterData(const char *data, int len, bool stripCtrl);
     ~ExpectRawCharacterData();
     void write(ExpectProgram &, std::ostream &) const;
+    bool literal(const char *&data, int &len) const;
 };
 
 class ExpectCtrl : public ExpectCharacterData {
@@ -158,6 +240,7 @@ class ExpectCtrl : public ExpectCharacterData {
 public:
     ExpectCtrl(const char **attributes);
     void write(ExpectProgram &, std::ostream &) const;
+    bool literal(const char *&data, int &len) const;
 };
 
 class Vt100EscapeCodes : public std::map<std::string, std::string> {
@@ -172,13 +255,24 @@ class ExpectVt100 : public ExpectCharacterData {
 public:
     ExpectVt100(const char **attributes);
     void write(ExpectProgram &, std::ostream &) const;
+    bool literal(const char *&data, int &len) const;
 };
 
 class ExpectExpect : public ExpectElement {
+    Pattern *compiled; // null if the pattern must be built at run time.
+    int flags; // for regcomp.
+    std::vector<std::string> captures; // variables to set from subexpressions.
 public:
-    ExpectExpect();
+    ExpectExpect(const char **attributes);
+    ~ExpectExpect();
+    void complete();
     void execute(ExpectProgram &) const;
+    const Pattern *pattern() const { return compiled; }
+    const Pattern &pattern(ExpectProgram &program) const; // perhaps from the program's cache: see PatternCache::get.
+    bool nocase() const { return (flags & REG_ICASE) != 0; }
+    std::string source(ExpectProgram &program) const;
     int match(ExpectProgram &program) const;
+    void capture(ExpectProgram &program, const regmatch_t *matches, int base, int count) const;
 };
 
 class ExpectDo : public ExpectElement {
@@ -223,6 +317,42 @@ telnetCommand(int command)
     }
 }
 
+/*
+ * Options <telnet accept> knows by name, and which ends we ask to perform
+ * them when they're acceptable. Others can be accepted by number, but are
+ * only ever agreed to when the other end asks.
+ */
+static const struct {
+    const char *name;
+    unsigned char code;
+    bool local;
+    bool remote;
+} telnetOptionNames[] = {
+    { "binary", TELOPT_BINARY, true, true },
+    { "echo", TELOPT_ECHO, false, true },
+    { "sga", TELOPT_SGA, true, true },
+    { "naws", TELOPT_NAWS, true, false },
+};
+
+/*
+ * Replace the program's current connection with a new one.
+ */
+static void
+attach(ExpectProgram &program, const Connection &connection)
+{
+    if (program.pooled && program.pooled->keepAlive)
+	program.release();
+    else
+	program.closeFds();
+    program.readFd = program.writeFd = connection.connect(program);
+    program.telnet = connection.telnet;
+    program.stripNul = connection.stripNul;
+    program.cork = connection.options.cork;
+    program.quickAck = connection.options.quickAck;
+    if (program.telnet)
+	program.telnetOffer();
+}
+
 /* 
  * Class Implementations
  */
@@ -272,18 +402,28 @@ ExpectHandlers::getNode(const char *name, const char **attributes)
 	return new ExpectListen(attributes);
     if (!strcmp(name, "network"))
 	return new ExpectNetwork(attributes);
+    if (!strcmp(name, "unix"))
+	return new ExpectUnix(attributes);
+    if (!strcmp(name, "unix-listen"))
+	return new ExpectUnixListen(attributes);
     if (!strcmp(name, "modem"))
 	return new ExpectModem(attributes);
     if (!strcmp(name, "choose"))
 	return new ExpectChoose();
     if (!strcmp(name, "expect") || !strcmp(name, "e"))
-	return new ExpectExpect();
+	return new ExpectExpect(attributes);
     if (!strcmp(name, "send") || !strcmp(name, "s"))
 	return new ExpectSend();
     if (!strcmp(name, "do"))
 	return new ExpectDo(attributes);
     if (!strcmp(name, "timeout"))
 	return new ExpectTimeout(attributes);
+    if (!strcmp(name, "quiet"))
+	return new ExpectQuiet(attributes);
+    if (!strcmp(name, "buffer"))
+	return new ExpectBuffer(attributes);
+    if (!strcmp(name, "telnet"))
+	return new ExpectTelnet(attributes);
     if (!strcmp(name, "br"))
 	return new ExpectRawCharacterData("\r\n", 2, false);
     if (!strcmp(name, "comment"))
@@ -310,6 +450,8 @@ ExpectHandlers::getNode(const char *name, const char **attributes)
 	return new ExpectPrint(attributes);
     if (!strcmp(name, "sleep"))
 	return new ExpectSleep(attributes);
+    if (!strcmp(name, "release"))
+	return new ExpectRelease(attributes);
     if (!strcmp(name, "strlen"))
 	return new ExpectStrlen(attributes);
     if (!strcmp(name, "strcat"))
@@ -356,6 +498,7 @@ void
 ExpectHandlers::endElement(const char *name)
 {
     sp--;
+    stack[sp]->complete();
 }
 
 ExpectNode::ExpectNode()
@@ -378,6 +521,11 @@ ExpectNode::execute(ExpectProgram &program) const
     executeChildren(program);
 }
 
+void
+ExpectNode::complete()
+{
+}
+
 ExpectNode::~ExpectNode()
 {
     ExpectNode *c;
@@ -402,6 +550,14 @@ ExpectCtrl::write(ExpectProgram &, std::ostream &os) const
     os << character;
 }
 
+bool
+ExpectCtrl::literal(const char *&data, int &len) const
+{
+    data = &character;
+    len = 1;
+    return true;
+}
+
 ExpectVt100::ExpectVt100(const char **attributes)
 {
     for (const char **cpp = attributes; cpp[0]; cpp += 2)
@@ -415,6 +571,14 @@ ExpectVt100::write(ExpectProgram &, std::ostream &os) const
     os << output;
 }
 
+bool
+ExpectVt100::literal(const char *&data, int &len) const
+{
+    data = output.data();
+    len = output.size();
+    return true;
+}
+
 ExpectLog::ExpectLog(const char **attributes)
 {
     const char **cpp;
@@ -433,7 +597,12 @@ ExpectLog::ExpectLog(const char **attributes)
 void
 ExpectLog::execute(ExpectProgram &program) const
 {
-    std::clog << message;
+    if (level > program.logLevel)
+	return;
+    if (program.trace)
+	program.trace->record(TraceEvent, message.data(), message.size());
+    else
+	std::clog << message;
 }
 
 ExpectLog::~ExpectLog()
@@ -441,41 +610,217 @@ ExpectLog::~ExpectLog()
 }
 
 ExpectChoose::ExpectChoose()
+    : dynamic(false)
+    , mixedCase(false)
+    , combined(0)
 {
 }
 
+ExpectChoose::~ExpectChoose()
+{
+    delete combined;
+}
+
 void
-ExpectChoose::execute(ExpectProgram &program) const
+ExpectChoose::complete()
+{
+    std::vector<std::string> sources;
+    std::vector<bool> usable;
+    const ExpectExpect *expected;
+    const ExpectNode *action;
+
+    branches.clear();
+    actions.clear();
+    dynamic = mixedCase = false;
+    for (expected = dynamic_cast<const ExpectExpect *>(firstChild);
+	    expected;
+	    expected = dynamic_cast<const ExpectExpect *>(action->nextSibling)) {
+	if ((action = expected->nextSibling) == 0)
+	    throw ExpectSyntaxException("choose has an expect with no action");
+	if (!branches.empty() && expected->nocase() != branches[0]->nocase())
+	    mixedCase = true;
+	branches.push_back(expected);
+	actions.push_back(action);
+	if (expected->pattern()) {
+	    sources.push_back(expected->pattern()->source);
+	    usable.push_back(expected->pattern()->usable());
+	} else {
+	    dynamic = true;
+	}
+    }
+
+    // Compile every branch into one pattern, so a single search of the data
+    // finds the earliest match among them.
+    delete combined;
+    combined = 0;
+    if (dynamic)
+	return;
+    std::string source;
+    if (!mixedCase && alternation(sources, usable, source, groups)) {
+	combined = new Pattern(source, caseFlags());
+	if (!combined->usable()) {
+	    delete combined;
+	    combined = 0;
+	}
+    }
+    if (!combined)
+	groups.assign(branches.size(), -1); // search for each separately.
+}
+
+int
+ExpectChoose::caseFlags() const
 {
-    int offset = -1;
+    return !branches.empty() && branches[0]->nocase() ? REG_ICASE : 0;
+}
+
+/*
+ * Return the branch whose pattern matches earliest in the received data, or
+ * -1 if none match yet. Of branches matching at the same place, the first
+ * listed wins.
+ */
+int
+ExpectChoose::match(ExpectProgram &program) const
+{
+    if (!dynamic)
+	return match(program, combined, groups);
+    std::vector<int> dynamicGroups;
+    if (!mixedCase) {
+	std::vector<std::string> sources;
+	std::vector<bool> usable;
+	for (size_t i = 0; i < branches.size(); i++) {
+	    sources.push_back(branches[i]->source(program));
+	    usable.push_back(branches[i]->pattern(program).usable());
+	}
+	std::string source;
+	if (alternation(sources, usable, source, dynamicGroups)) {
+	    const Pattern &pattern = program.patterns.get(source, caseFlags());
+	    if (pattern.usable())
+		return match(program, &pattern, dynamicGroups);
+	}
+    }
+    dynamicGroups.assign(branches.size(), -1);
+    return match(program, 0, dynamicGroups);
+}
+
+/*
+ * Search with the combined pattern, if there is one, and separately for the
+ * branches left out of it, consuming data up to the end of the winner's
+ * match.
+ */
+int
+ExpectChoose::match(ExpectProgram &program, const Pattern *pattern, const std::vector<int> &branchGroups) const
+{
+    int best = -1;
+    int base = 0, count = 0; // the winner's subexpressions in matches.
+    std::vector<regmatch_t> matches;
+    if (pattern) {
+	int groupCount = pattern->groups;
+	matches.resize(groupCount + 1);
+	if (program.find(*pattern, &matches[0], matches.size()) != -1) {
+	    for (size_t i = 0; i < branchGroups.size() && best == -1; i++)
+		if (branchGroups[i] != -1 && matches[branchGroups[i]].rm_so != -1)
+		    best = i;
+	    // The branch's own subexpressions run up to the next combined branch's.
+	    int end = groupCount + 1;
+	    for (size_t i = best + 1; i < branchGroups.size() && end == groupCount + 1; i++)
+		if (branchGroups[i] != -1)
+		    end = branchGroups[i];
+	    base = branchGroups[best];
+	    count = end - base - 1;
+	}
+    }
+    /*
+     * The combined pattern prefers the longest match where it finds one, not
+     * the first listed, so combined branches listed before the one it found
+     * are tried again by themselves in case they match there too. Branches
+     * left out of it are each tried anyway. (pattern may have been evicted
+     * from the program's cache by now.)
+     */
+    for (size_t i = 0; i < branches.size(); i++) {
+	if (int(i) == best || (branchGroups[i] != -1 && (best == -1 || int(i) > best)))
+	    continue;
+	const Pattern &own = branches[i]->pattern(program);
+	std::vector<regmatch_t> ownMatches(own.groups + 1);
+	if (program.find(own, &ownMatches[0], ownMatches.size()) == -1)
+	    continue;
+	int start = ownMatches[0].rm_so;
+	if (best == -1 || start < matches[0].rm_so || (start == matches[0].rm_so && int(i) < best)) {
+	    best = i;
+	    matches.swap(ownMatches);
+	    base = 0;
+	    count = own.groups;
+	}
+    }
+    if (best == -1)
+	return -1;
+    program.consume(matches[0]);
+    branches[best]->capture(program, &matches[0], base, count);
+    return best;
+}
 
+void
+ExpectChoose::execute(ExpectProgram &program) const
+{
+    int branch;
+    program.expectStarted(this);
     try {
-	for (;;) {
-	    ExpectExpect *expected;
-	    ExpectNode *action;
-	    for (expected = dynamic_cast<ExpectExpect *>(firstChild);
-		    expected;
-		    expected = dynamic_cast<ExpectExpect *>(action->nextSibling)) {
-		action = expected->nextSibling;
-		if ((offset = expected->match(program)) != -1) {
-		    program.execute(action);
-		    break;
-		}
-	    }
-	    if (offset != -1)
-		break;
+	while ((branch = match(program)) == -1)
 	    program.receive();
-	}
+	program.expectFinished(this, true);
     }
     catch (const UnixException &ux) {
+	program.expectFinished(this, false);
 	if (ux.uxError == ETIMEDOUT)
 	    throw ExpectTimeoutException(program.matching, program.status,
-	    std::string(program.receiveData, program.receiveOffset));
+	    std::string(program.receiveData + program.receiveStart,
+		program.receiveOffset - program.receiveStart));
+	return;
+    }
+    // Outside the try: the action's own failures aren't ours.
+    program.execute(actions[branch]);
+}
+
+ExpectExpect::ExpectExpect(const char **attributes)
+    : compiled(0)
+    , flags(0)
+{
+    const char *p = ExpatParserHandlers::getAttribute(attributes, "nocase");
+    if (p && ExpatParserHandlers::boolAttribute(p))
+	flags |= REG_ICASE;
+    if ((p = ExpatParserHandlers::getAttribute(attributes, "capture")) != 0) {
+	std::stringstream names(p);
+	std::string name;
+	while (std::getline(names, name, ','))
+	    captures.push_back(name);
     }
 }
 
-ExpectExpect::ExpectExpect()
+ExpectExpect::~ExpectExpect()
 {
+    delete compiled;
+}
+
+void
+ExpectExpect::complete()
+{
+    // If the pattern is made only of literal text, compile it once, now.
+    std::string source;
+    bool literal = true;
+    for (const ExpectNode *c = firstChild; c; c = c->nextSibling) {
+	const ExpectCharacterData *chars = dynamic_cast<const ExpectCharacterData *>(c);
+	if (!chars)
+	    throw ExpectSyntaxException("expect may contain only character data");
+	const char *data;
+	int len;
+	if (literal && chars->literal(data, len))
+	    source.append(data, len);
+	else
+	    literal = false;
+    }
+    if (!literal)
+	return;
+    delete compiled;
+    compiled = new Pattern(source, flags);
 }
 
 ExpectSleep::ExpectSleep(const char **attributes)
@@ -496,29 +841,69 @@ void
 ExpectSleep::execute(ExpectProgram &program) const
 {
     program.flush();
-    usleep(delay);
+    program.wait(-1, 0, (delay + 999) / 1000);
 }
 
-int
-ExpectExpect::match(ExpectProgram &program) const
+std::string
+ExpectExpect::source(ExpectProgram &program) const
 {
+    if (compiled)
+	return compiled->source;
     std::stringstream strm;
     for (const ExpectNode *c = firstChild; c; c = c->nextSibling)
 	dynamic_cast<const ExpectCharacterData &>(*c).write(program, strm);
-    return program.match(strm.str());
+    return strm.str();
+}
+
+const Pattern &
+ExpectExpect::pattern(ExpectProgram &program) const
+{
+    return compiled ? *compiled : program.patterns.get(source(program), flags);
+}
+
+int
+ExpectExpect::match(ExpectProgram &program) const
+{
+    const Pattern &pattern = this->pattern(program);
+    if (captures.empty())
+	return program.match(pattern);
+    std::vector<regmatch_t> matches(pattern.groups + 1);
+    if (program.match(pattern, &matches[0], matches.size()) == -1)
+	return -1;
+    capture(program, &matches[0], 0, pattern.groups);
+    return 0;
+}
+
+/*
+ * Store subexpressions of a match in the variables named by the capture
+ * attribute. base is the subexpression enclosing our pattern, if it was
+ * matched as part of a larger one, and count is how many our pattern has:
+ * names beyond those are set empty.
+ */
+void
+ExpectExpect::capture(ExpectProgram &program, const regmatch_t *matches, int base, int count) const
+{
+    regmatch_t none;
+    none.rm_so = none.rm_eo = -1;
+    for (size_t i = 0; i < captures.size(); i++)
+	program.capture(captures[i], int(i) < count ? matches[base + i + 1] : none);
 }
 
 void
 ExpectExpect::execute(ExpectProgram &program) const
 {
+    program.expectStarted(this);
     try {
 	while (match(program) == -1)
 	    program.receive();
+	program.expectFinished(this, true);
     }
     catch (const UnixException &ux) {
+	program.expectFinished(this, false);
 	if (ux.uxError == ETIMEDOUT)
 	    throw ExpectTimeoutException(program.matching, program.status,
-	    std::string(program.receiveData, program.receiveOffset));
+	    std::string(program.receiveData + program.receiveStart,
+		program.receiveOffset - program.receiveStart));
     }
 }
 
@@ -552,16 +937,59 @@ ExpectSyntaxException::describe(std::ostream &output) const
 }
 
 
+/*
+ * Work out what to send: consecutive literal children are joined into one
+ * segment, and the rest are left to write themselves at run time.
+ */
 void
-ExpectSend::execute(ExpectProgram &program) const
+ExpectSend::complete()
 {
-    // XXX: Implement output stream for fds to avoid intermediate string buffer
-    std::stringstream strm;
     for (const ExpectNode *cdp = firstChild; cdp; cdp = cdp->nextSibling)
-	dynamic_cast <const ExpectCharacterData &>(*cdp).write(program, strm);
-    std::string s = strm.str();
-    program.send(s.data(), s.size());
+	if (!dynamic_cast<const ExpectCharacterData *>(cdp))
+	    throw ExpectSyntaxException("send may contain only character data");
+    segments.clear();
+    joined.clear();
+    for (const ExpectNode *cdp = firstChild; cdp; ) {
+	const ExpectCharacterData &chars = dynamic_cast<const ExpectCharacterData &>(*cdp);
+	Segment segment;
+	if (!chars.literal(segment.data, segment.len)) {
+	    segment.node = &chars;
+	    segments.push_back(segment);
+	    cdp = cdp->nextSibling;
+	    continue;
+	}
+	segment.node = 0;
+	const char *data;
+	int len;
+	const ExpectNode *next = cdp->nextSibling;
+	if (next && dynamic_cast<const ExpectCharacterData &>(*next).literal(data, len)) {
+	    std::string run;
+	    for (; cdp && dynamic_cast<const ExpectCharacterData &>(*cdp).literal(data, len);
+		    cdp = cdp->nextSibling)
+		run.append(data, len);
+	    joined.push_back(run);
+	    segment.data = joined.back().data();
+	    segment.len = joined.back().size();
+	} else {
+	    cdp = next;
+	}
+	if (segment.len != 0)
+	    segments.push_back(segment);
+    }
+}
 
+void
+ExpectSend::execute(ExpectProgram &program) const
+{
+    program.startMessage();
+    for (size_t i = 0; i < segments.size(); i++) {
+	const Segment &segment = segments[i];
+	if (segment.node)
+	    segment.node->write(program, program.sendStream);
+	else
+	    program.sendStatic(segment.data, segment.len);
+    }
+    program.endMessage();
 }
 
 ExpectRawCharacterData::ExpectRawCharacterData(const char *newData, int newLen, bool stripCtrl)
@@ -588,25 +1016,61 @@ ExpectRawCharacterData::write(ExpectProgram &, std::ostream &os) const
     os.write(data, len);
 }
 
+bool
+ExpectRawCharacterData::literal(const char *&data_, int &len_) const
+{
+    data_ = data;
+    len_ = len;
+    return true;
+}
+
 void
 ExpectCharacterData::execute(ExpectProgram &program) const
 { }
 
+bool
+ExpectCharacterData::literal(const char *&, int &) const
+{
+    return false;
+}
+
 ExpectProgram::ExpectProgram(int maxBuf, std::map<std::string, std::string> &variables)
-    : dripRate(0)
+    : sendStreamBuf(*this)
     , variables(variables)
     , lastVisited(0)
     , readFd(-1)
     , writeFd(-1)
+    , pooled(0)
+    , telnet(true)
+    , stripNul(true)
+    , cork(false)
+    , quickAck(false)
+    , telnetState(TelnetData)
+    , telnetVerb(0)
     , timeout(2000)
-    , expectDelay(50)
-    , receiveSize(maxBuf - 1)
-    , receiveData(new char[maxBuf])
+    , expectDelay(0)
+    , receiveRing(new RingBuffer(maxBuf))
+    , receiveSize(receiveRing->size())
+    , receiveData(receiveRing->at(0))
+    , receiveStart(0)
     , receiveOffset(0)
-    , sendSize(maxBuf - 1)
+    , receiveDropped(0)
+    , bytesReceived(0)
+    , bytesSent(0)
+    , receiveHighWater(0)
+    , receivePeak(0)
+    , receiveBase(maxBuf)
+    , sendBase(maxBuf)
+    , bufferLimit(std::max(maxBuf, 1 << 20))
+    , sendSize(maxBuf)
     , sendData(new char[maxBuf])
     , sendOffset(0)
-    , logFacility(0)
+    , sendQueued(0)
+    , sendMark(0)
+    , inMessage(false)
+    , sendStream(&sendStreamBuf)
+    , logLevel(2)
+    , trace(0)
 {
 }
 
@@ -615,117 +1079,494 @@ ExpectProgram::statusUpdate(std::string)
 {
 }
 
+void
+ExpectProgram::expectStarted(const ExpectNode *)
+{
+}
+
+void
+ExpectProgram::expectFinished(const ExpectNode *, bool)
+{
+}
+
+void
+ExpectProgram::connectStarted(const ExpectNode *)
+{
+}
+
+void
+ExpectProgram::connectFinished(const ExpectNode *, bool)
+{
+}
+
+/*
+ * Set the sizes buffers start at, and the most they may grow to.
+ */
+void
+ExpectProgram::setBuffers(int receive, int send, int limit)
+{
+    receiveBase = receive;
+    sendBase = send;
+    bufferLimit = std::max(limit, std::max(receive, send));
+    if (receiveSize != receiveBase)
+	resizeReceive(receiveBase);
+    if (sendSize != sendBase)
+	resizeSend(sendBase);
+}
+
+/*
+ * Move the unconsumed receive data to a new buffer.
+ */
+void
+ExpectProgram::resizeReceive(int size)
+{
+    int live = receiveOffset - receiveStart;
+    size = std::max(size, live);
+    if (RingBuffer::roundedSize(size) == size_t(receiveSize))
+	return; // the ring would be no different.
+    RingBuffer *ring = new RingBuffer(size);
+    saveCaptures();
+    memcpy(ring->at(0), receiveData + receiveStart, live);
+    delete receiveRing;
+    receiveRing = ring;
+    receiveSize = ring->size();
+    receiveData = ring->at(0);
+    receiveStart = 0;
+    receiveOffset = receivePeak = live;
+}
+
+void
+ExpectProgram::resizeSend(int size)
+{
+    if (size < sendOffset)
+	flush();
+    char *data = new char[size];
+    memcpy(data, sendData, sendOffset);
+    // Queued copies move with the buffer.
+    for (size_t i = 0; i < sendQueue.size(); i++) {
+	char *base = (char *)sendQueue[i].iov_base;
+	if (base >= sendData && base < sendData + sendSize)
+	    sendQueue[i].iov_base = data + (base - sendData);
+    }
+    delete[] sendData;
+    sendData = data;
+    sendSize = size;
+}
+
+/*
+ * Look for the pattern in the unconsumed data. On success, the data up to the
+ * end of the match is consumed, and matches holds the offsets into
+ * receiveData of the match and any subexpressions.
+ */
+int
+ExpectProgram::match(const Pattern &pattern, regmatch_t *matches, size_t nmatch)
+{
+    regmatch_t whole;
+    if (nmatch == 0) {
+	matches = &whole;
+	nmatch = 1;
+    }
+    if (find(pattern, matches, nmatch) == -1)
+	return -1;
+    consume(matches[0]);
+    return 0;
+}
+
+/*
+ * As match(), but consuming nothing, so the caller can choose between the
+ * matches of several patterns. nmatch must be at least 1.
+ */
 int
-ExpectProgram::match(std::string s)
+ExpectProgram::find(const Pattern &pattern, regmatch_t *matches, size_t nmatch)
 {
-    regex_t re;
+    const char *data = receiveData + receiveStart;
+    int len = receiveOffset - receiveStart;
 
-    matching = s;
+    matching = pattern.source;
 
-    receiveData[receiveOffset] = 0;
-    const char *cp = s.c_str();
-    // XXX: Really need to cache the regex compile in the expect or chardata node if
-    // not dynamic.
-    if (regcomp(&re, cp, REG_NOSUB) == 0) {
-	if (regexec(&re, receiveData, 0, 0, 0) == 0) {
-	    receiveOffset = 0; // discard any data already received.
-	    regfree(&re);
-	    return 0;
+    /*
+     * If this pattern has already failed against the start of the data, a
+     * match can only end in data received since, so we needn't look further
+     * back than the longest match the pattern allows.
+     */
+    int &done = scanned[pattern.serial];
+    int start = pattern.maxLength == -1 ? 0 : std::max(0, done - pattern.maxLength);
+    done = len;
+
+    if (!pattern.execute(data, start, len, matches, nmatch))
+	return -1;
+
+    for (size_t i = 0; i < nmatch; i++) {
+	if (matches[i].rm_so != -1) {
+	    matches[i].rm_so += receiveStart;
+	    matches[i].rm_eo += receiveStart;
 	}
     }
-    regfree(&re);
-    return -1;
+    return 0;
 }
 
+// Anything after the match is left for the next one.
+void
+ExpectProgram::consume(const regmatch_t &match)
+{
+    receiveStart = match.rm_eo;
+    scanned.clear();
+}
+
+/*
+ * Set a variable from part of a match. The value stays in the receive buffer
+ * until the buffer is compacted.
+ */
+void
+ExpectProgram::capture(const std::string &name, const regmatch_t &match)
+{
+    if (match.rm_so == -1) {
+	captures.erase(name);
+	variables[name] = "";
+    } else {
+	captures[name] = std::make_pair(int(match.rm_so), int(match.rm_eo));
+    }
+}
+
+void
+ExpectProgram::saveCaptures()
+{
+    std::map<std::string, std::pair<int, int> >::iterator i;
+    for (i = captures.begin(); i != captures.end(); ++i)
+	variables[i->first].assign(receiveData + i->second.first, i->second.second - i->second.first);
+    captures.clear();
+}
+
+void
+ExpectProgram::writeVariable(std::ostream &os, const std::string &name)
+{
+    std::map<std::string, std::pair<int, int> >::const_iterator i = captures.find(name);
+    if (i != captures.end())
+	os.write(receiveData + i->second.first, i->second.second - i->second.first);
+    else
+	os << variables[name];
+}
+
+/*
+ * Add data to the end of the send queue, extending the last entry if the
+ * data follows on from it in memory.
+ */
+void
+ExpectProgram::queue(char *data, int len)
+{
+    if (sendQueue.size() > sendMark) {
+	iovec &last = sendQueue.back();
+	if ((char *)last.iov_base + last.iov_len == data) {
+	    last.iov_len += len;
+	    sendQueued += len;
+	    return;
+	}
+    }
+    iovec v;
+    v.iov_base = data;
+    v.iov_len = len;
+    sendQueue.push_back(v);
+    sendQueued += len;
+}
+
+/*
+ * Queue a copy of some data for sending.
+ */
 void
 ExpectProgram::sendRaw(const char *data, int len)
 {
-    int offset = 0;
-    do {
+    while (len > 0) {
+	if (sendOffset == sendSize) {
+	    if (sendSize < bufferLimit)
+		resizeSend(std::min(sendSize * 2, bufferLimit));
+	    else
+		flush();
+	}
 	int avail = std::min<int>(len, sendSize - sendOffset);
-	memcpy(sendData + sendOffset, data + offset, avail);
-	offset += avail;
+	memcpy(sendData + sendOffset, data, avail);
+	queue(sendData + sendOffset, avail);
 	sendOffset += avail;
-	if (sendOffset == sendSize)
-	    flush();
-    } while (offset < len);
+	data += avail;
+	len -= avail;
+    }
 }
 
+/*
+ * Queue data for sending without copying it.
+ */
 void
-ExpectProgram::flush()
+ExpectProgram::sendStatic(const char *data, int len)
 {
-    int sent;
+    if (len != 0)
+	queue(const_cast<char *>(data), len);
+}
 
-    for (int total = 0; total < sendOffset; total += sent) {
-	if (dripRate != 0) {
-	    sent = ::write(writeFd, sendData + total, 1);
-	    usleep(dripRate * 1000);
-	} else {
-	    sent = ::write(writeFd, sendData + total, sendOffset - total);
+void
+ExpectProgram::setCork(bool on)
+{
+#ifdef TCP_CORK
+    int value = on;
+    setsockopt(writeFd, IPPROTO_TCP, TCP_CORK, &value, sizeof value);
+#endif
+}
+
+void
+ExpectProgram::rearmQuickAck()
+{
+#ifdef TCP_QUICKACK
+    int value = 1;
+    setsockopt(readFd, IPPROTO_TCP, TCP_QUICKACK, &value, sizeof value);
+#endif
+}
+
+void
+ExpectProgram::flush()
+{
+    size_t next = 0; // first entry not completely sent.
+    size_t left = sendQueued;
+    bool corked = false;
+
+    // A message too big for the buffer goes in pieces: log each piece as
+    // it goes, before the queue it's in is consumed.
+    if (inMessage && sendQueue.size() > sendMark)
+	logData(TraceSend, sendQueue.data() + sendMark, sendQueue.size() - sendMark);
+
+    while (next < sendQueue.size()) {
+	size_t count = std::min<size_t>(sendQueue.size() - next, IOV_MAX);
+	// When pacing, wait until a full burst (or all that's left) can go.
+	size_t allowed = pacer.available();
+	int msec = pacer.delay(left);
+	if (msec > 0) {
+	    if (corked)
+		setCork(corked = false); // each burst should go when it's allowed.
+	    wait(-1, 0, msec);
+	    continue;
+	}
+	/*
+	 * Everything queued goes to the kernel in one writev if it can. If
+	 * it takes more, cork the socket so the pieces don't go out as
+	 * short segments.
+	 */
+	if (cork && !corked && left < sendQueued)
+	    setCork(corked = true);
+	// Hold back what the pacer won't allow yet by trimming the last iovec.
+	size_t total = 0, trimmed = 0;
+	for (size_t i = 0; i < count; i++) {
+	    total += sendQueue[next + i].iov_len;
+	    if (total >= allowed) {
+		count = i + 1;
+		trimmed = total - allowed;
+		break;
+	    }
 	}
+	iovec &last = sendQueue[next + count - 1];
+	last.iov_len -= trimmed;
+	ssize_t sent;
+	try {
+	    sent = writeSome(writeFd, &sendQueue[next], count, timeout);
+	}
+	catch (...) {
+	    last.iov_len += trimmed; // or a later flush would lose the rest.
+	    throw;
+	}
+	last.iov_len += trimmed;
 	switch (sent) {
 	case -1:
 	    throw UnixException(errno, "write");
 	case 0:
 	    throw UnixException(0, "write");
 	}
+	pacer.consume(sent);
+	left -= sent;
+	while (sent > 0) {
+	    iovec &v = sendQueue[next];
+	    if (size_t(sent) < v.iov_len) {
+		v.iov_base = (char *)v.iov_base + sent;
+		v.iov_len -= sent;
+		break;
+	    }
+	    sent -= v.iov_len;
+	    next++;
+	}
     }
+    if (corked)
+	setCork(false);
+    size_t flushed = sendQueued;
+    bytesSent += flushed;
+    sendQueue.clear();
+    sendQueued = sendMark = 0;
     sendOffset = 0;
+    // Give back memory a big send needed, once sends are small again.
+    if (sendSize > sendBase && flushed < size_t(sendSize / 4))
+	resizeSend(std::max(sendBase, sendSize / 2));
 }
 
 void
 ExpectProgram::send(const char *data, int len)
 {
-    std::clog << "SEND " << printableString(data, len) << std::endl;
+    iovec v;
+    v.iov_base = const_cast<char *>(data);
+    v.iov_len = len;
+    logData(TraceSend, &v, 1);
     sendRaw(data, len);
 }
 
+/*
+ * Group what's sent until endMessage() for logging.
+ */
 void
-ExpectProgram::receiveRaw()
+ExpectProgram::startMessage()
 {
-    flush(); // Don't have any outstanding unsent data.
-    if (expectDelay) // The sleep makes it more likely that a single transaction will read more data.
-	usleep(expectDelay * 1000);
+    sendMark = sendQueue.size();
+    inMessage = true;
+}
 
-    // Make sure we have at least 1/8th of the receive buffer free.
-    struct pollfd pfd;
-    pfd.fd = readFd;
-    pfd.events = POLLIN|POLLPRI;
+void
+ExpectProgram::endMessage()
+{
+    logData(TraceSend, sendQueue.data() + sendMark, sendQueue.size() - sendMark);
+    sendMark = sendQueue.size();
+    inMessage = false;
+}
 
-    if (poll(&pfd, 1, timeout) == 0) {
-	if (poll(&pfd, 1, 0) == 1)
-	    abort();
-	throw UnixException(ETIMEDOUT, "poll");
+void
+ExpectProgram::logEvent(const std::string &text)
+{
+    if (logLevel < 1)
+	return;
+    if (trace)
+	trace->record(TraceEvent, text.data(), text.size());
+    else
+	Waiter::logEvent(text);
+}
+
+void
+ExpectProgram::logData(TraceKind kind, const iovec *iov, int count)
+{
+    if (logLevel < 2)
+	return;
+    if (trace) {
+	trace->record(kind, iov, count);
+	return;
     }
+    std::string text = kind == TraceSend ? "SEND " : "RECV ";
+    for (int i = 0; i < count; i++)
+	text += printableString((const char *)iov[i].iov_base, iov[i].iov_len);
+    Waiter::logEvent(text);
+}
 
-    int received = ::read(readFd, receiveData + receiveOffset, receiveSize - receiveOffset);
+int
+SendStreamBuf::overflow(int c)
+{
+    if (c != EOF) {
+	char ch = c;
+	program.sendRaw(&ch, 1);
+    }
+    return c;
+}
+
+std::streamsize
+SendStreamBuf::xsputn(const char *data, std::streamsize len)
+{
+    program.sendRaw(data, len);
+    return len;
+}
+
+/*
+ * Wait for data, then take everything that's already arrived. With a quiet
+ * period set, keep reading until the peer has been silent for that long, so
+ * a response that trickles in is matched in one go.
+ */
+void
+ExpectProgram::receiveRaw()
+{
+    flush(); // Don't have any outstanding unsent data.
+
+    ssize_t wanted = receiveSize - receiveOffset;
+    ssize_t received = readSome(readFd, receiveData + receiveOffset, wanted, timeout);
 
     switch (received) {
-    case 0:
     case -1:
-	throw UnixException(errno, "read");
+	throw UnixException(errno, errno == ETIMEDOUT ? "poll" : "read");
+    case 0:
+	throw UnixException(0, "read");
     default:
 	receiveOffset += received;
 	break;
     }
+
+    /*
+     * A short read took everything there was, so without a delay to wait
+     * for more, another read would only fail with EAGAIN.
+     */
+    while (receiveOffset < receiveSize && (received == wanted || expectDelay > 0)) {
+	wanted = receiveSize - receiveOffset;
+	received = readSome(readFd, receiveData + receiveOffset, wanted, expectDelay);
+	if (received <= 0)
+	    break; // Let the matcher see what we have; the next read will fail again.
+	receiveOffset += received;
+    }
+    if (quickAck)
+	rearmQuickAck();
+}
+
+/*
+ * Make sure at least 1/8th of the receive buffer is free, by discarding data
+ * consumed by earlier matches, then by growing the buffer, and finally by
+ * discarding the oldest unconsumed data. Discarding copies nothing: the
+ * window onto the ring just moves forward.
+ */
+void
+ExpectProgram::compact()
+{
+    int minFree = receiveSize / 8;
+    int live = receiveOffset - receiveStart;
+
+    if (live == 0) {
+	// Idle: give back memory a big response needed, once responses are small again.
+	if (receiveSize > receiveBase && receivePeak < receiveSize / 4)
+	    resizeReceive(std::max(receiveBase, receiveSize / 2));
+	receivePeak = 0;
+    }
+    if (receiveSize - receiveOffset >= minFree)
+	return;
+    if (receiveSize - live < minFree && receiveSize < bufferLimit) {
+	resizeReceive(std::min(receiveSize * 2, bufferLimit));
+	return;
+    }
+    saveCaptures();
+    int drop = std::max(0, minFree - (receiveSize - receiveOffset + receiveStart));
+    if (drop != 0) {
+	receiveDropped += drop;
+	std::ostringstream os;
+	os << "receive buffer full: discarding " << drop << " unmatched bytes";
+	logEvent(os.str());
+    }
+    receiveData = receiveRing->at(receiveData - receiveRing->at(0) + receiveStart + drop);
+    receiveOffset -= receiveStart + drop;
+    receiveStart = 0;
+    for (std::map<unsigned, int>::iterator i = scanned.begin(); i != scanned.end(); ++i)
+	i->second = std::max(0, i->second - drop);
 }
 
 void
 ExpectProgram::receive()
 {
-    int origOffset = receiveOffset;
+    int origOffset;
     do {
-	int minFree = receiveSize / 8;
-	if ((receiveSize - receiveOffset) < minFree) {
-	    memmove(receiveData, receiveData + minFree, receiveOffset - minFree);
-	    receiveOffset -= minFree;
-	    origOffset = std::max(0, origOffset - minFree);
-	}
+	compact();
+	origOffset = receiveOffset;
 	receiveRaw();
-	stripTelnet();
-    } while (receiveOffset == 0);
+	stripTelnet(origOffset);
+    } while (receiveOffset == origOffset);
+    bytesReceived += receiveOffset - origOffset;
+    receiveHighWater = std::max(receiveHighWater, receiveOffset - receiveStart);
+    receivePeak = std::max(receivePeak, receiveOffset - receiveStart);
 
-    std::clog << "RECV " << printableString(receiveData + origOffset, receiveOffset - origOffset) << std::endl;
+    iovec v;
+    v.iov_base = receiveData + origOffset;
+    v.iov_len = receiveOffset - origOffset;
+    logData(TraceReceive, &v, 1);
 }
 
 void
@@ -735,45 +1576,185 @@ ExpectProgram::need(int size)
 	receiveRaw();
 }
 
+TelnetOptions::TelnetOptions()
+    : cols(80)
+    , rows(24)
+{
+    memset(accept, 0, sizeof accept);
+    reset();
+}
+
 void
-ExpectProgram::stripTelnet()
+TelnetOptions::reset()
 {
-    unsigned char c;
-    int i, j;
-    unsigned char response[1024];
-    int responseSize = 0;
+    memset(local, No, sizeof local);
+    memset(remote, No, sizeof remote);
+}
 
-    for (i = j = 0; i < receiveOffset; i++) {
-	switch (c = (unsigned char)receiveData[i]) {
-	case IAC:
-	    need(++i);
-	    switch (c = receiveData[i]) {
+void
+ExpectProgram::telnetReply(unsigned char verb, unsigned char option)
+{
+    char response[3];
+    response[0] = IAC;
+    response[1] = verb;
+    response[2] = option;
+    sendRaw(response, sizeof response);
+}
+
+/*
+ * Answer a request to enable or disable an option, agreeing to those in
+ * telnetOptions.accept. Following RFC 1143, we only answer requests that
+ * would change an option's state, so neither end can start a loop, and
+ * we don't answer the other end's reply to our own request.
+ */
+void
+ExpectProgram::negotiate(unsigned char verb, unsigned char option)
+{
+    if (logLevel >= 1) {
+	std::ostringstream os;
+	os << "receive " << telnetCommand(verb) << " " << int(option);
+	logEvent(os.str());
+    }
+    bool enable = verb == DO || verb == WILL;
+    bool ours = verb == DO || verb == DONT; // asking us, rather than telling us.
+    unsigned char &state = ours ? telnetOptions.local[option] : telnetOptions.remote[option];
+
+    if (enable) {
+	if (state == TelnetOptions::Yes)
+	    return;
+	if (state == TelnetOptions::No) {
+	    if (!telnetOptions.accept[option]) {
+		telnetReply(ours ? WONT : DONT, option);
+		return;
+	    }
+	    telnetReply(ours ? WILL : DO, option);
+	}
+	state = TelnetOptions::Yes;
+	if (ours && option == TELOPT_NAWS)
+	    sendWindowSize();
+    } else {
+	if (state == TelnetOptions::Yes)
+	    telnetReply(ours ? WONT : DONT, option);
+	state = TelnetOptions::No;
+    }
+}
+
+void
+ExpectProgram::telnetOffer()
+{
+    for (size_t i = 0; i < sizeof telnetOptionNames / sizeof telnetOptionNames[0]; i++) {
+	unsigned char option = telnetOptionNames[i].code;
+	if (!telnetOptions.accept[option])
+	    continue;
+	if (telnetOptionNames[i].local && telnetOptions.local[option] == TelnetOptions::No) {
+	    telnetReply(WILL, option);
+	    telnetOptions.local[option] = TelnetOptions::WantYes;
+	}
+	if (telnetOptionNames[i].remote && telnetOptions.remote[option] == TelnetOptions::No) {
+	    telnetReply(DO, option);
+	    telnetOptions.remote[option] = TelnetOptions::WantYes;
+	}
+    }
+}
+
+/*
+ * Tell the other end our window size (RFC 1073).
+ */
+void
+ExpectProgram::sendWindowSize()
+{
+    const char start[] = { (char)IAC, (char)SB, (char)TELOPT_NAWS };
+    const char end[] = { (char)IAC, (char)SE };
+    int size[] = { telnetOptions.cols, telnetOptions.rows };
+
+    sendRaw(start, sizeof start);
+    for (int i = 0; i < 2; i++) {
+	for (int shift = 8; shift >= 0; shift -= 8) {
+	    char c = (size[i] >> shift) & 0xff;
+	    sendRaw(&c, 1);
+	    if (c == (char)IAC)
+		sendRaw(&c, 1);
+	}
+    }
+    sendRaw(end, sizeof end);
+}
+
+/*
+ * Filter the bytes received from "from" onwards, answering telnet commands
+ * and dropping NULs as configured. Each byte is looked at once: a command
+ * split across reads is finished off by the next call, from telnetState.
+ * Runs of ordinary data are found with findEither and moved down in one go.
+ */
+void
+ExpectProgram::stripTelnet(int from)
+{
+    if (!telnet && !stripNul)
+	return; // binary-transparent connection.
+
+    const char iac = (char)IAC;
+    char *data = receiveData;
+    int i = from, j = from;
+
+    while (i < receiveOffset) {
+	unsigned char c;
+	switch (telnetState) {
+	case TelnetCommand:
+	    c = data[i++];
+	    telnetState = TelnetData;
+	    switch (c) {
+	    case IAC:
+		data[j++] = iac; // escaped data byte.
+		break;
 	    case DO:
 	    case DONT:
 	    case WILL:
 	    case WONT:
-		response[responseSize++] = IAC;
-		response[responseSize++] = (c == DO || c == DONT) ? WONT : DONT;
-		need(++i);
-		std::clog << "receive " << telnetCommand(c) << " " << int(receiveData[i]) << std::endl;
-		response[responseSize++] = receiveData[i];
+		telnetVerb = c;
+		telnetState = TelnetOption;
+		break;
+	    case SB:
+		telnetState = TelnetSub; // we ask for nothing that's sent this way.
+		break;
+	    case GA:
+	    case NOP:
 		break;
 	    default:
-		std::clog << "unknown telnet command " << int(c) << std::endl;
-                break;
+		std::ostringstream os;
+		os << "unknown telnet command " << int(c);
+		logEvent(os.str());
+		break;
 	    }
-	    break;
-
-	case '\0':
-	    break; /* Discard nulls */
-
-	default:
-	    receiveData[j++] = c;
+	    continue;
+	case TelnetOption:
+	    telnetState = TelnetData;
+	    negotiate(telnetVerb, data[i++]);
+	    continue;
+	case TelnetSub: {
+	    const char *end = (const char *)memchr(data + i, iac, receiveOffset - i);
+	    i = end ? end - data + 1 : receiveOffset;
+	    if (end)
+		telnetState = TelnetSubIac;
+	    continue;
+	}
+	case TelnetSubIac:
+	    telnetState = (unsigned char)data[i++] == SE ? TelnetData : TelnetSub;
+	    continue;
+	case TelnetData:
 	    break;
 	}
+	const char *special = findEither(data + i, receiveOffset - i,
+		telnet ? iac : '\0', stripNul ? '\0' : iac);
+	int run = (special ? special - data : receiveOffset) - i;
+	if (j != i)
+	    memmove(data + j, data + i, run);
+	i += run;
+	j += run;
+	if (special) {
+	    i++;
+	    if (*special == iac && telnet)
+		telnetState = TelnetCommand;
+	}
     }
-    if (responseSize != 0)
-	sendRaw((const char *)response, responseSize);
     receiveOffset = j;
 }
 
@@ -794,30 +1775,69 @@ ExpectProgram::closeFds()
     if (readFd != -1 && readFd != writeFd)
 	::close(readFd);
     readFd = writeFd = -1;
+    pooled = 0;
+    telnetState = TelnetData;
+    telnetOptions.reset();
+}
+
+/*
+ * Anything already received but not matched is left in the buffer, as when
+ * changing connections, but the connection must have nothing more to read
+ * to go back to its pool.
+ */
+void
+ExpectProgram::release()
+{
+    if (pooled && readFd != -1 && readFd == writeFd) {
+	flush();
+	pooled->release(*this, readFd);
+	readFd = writeFd = -1;
+    }
+    closeFds();
 }
 
 void
 ExpectProgram::run(const ExpectNode *code, int r, int w)
 {
-    receiveOffset = sendOffset = 0;
+    receiveStart = receiveOffset = sendOffset = 0;
+    sendQueue.clear();
+    sendQueued = sendMark = 0;
+    inMessage = false;
+    captures.clear();
+    scanned.clear();
+    telnetState = TelnetData;
     exceptionHandler = 0;
 
+    /*
+     * Closing may flush, and a session can switch to another while it
+     * does, so the exception is carried out of the catch block first: the
+     * exception being handled belongs to the thread, not the session.
+     */
+    std::exception_ptr error;
     try {
 	readFd = r;
 	writeFd = w;
 	execute(code);
+	if (pooled && pooled->keepAlive)
+	    release();
 	closeFds();
     }
     catch (...) {
-	closeFds();
-	throw;
+	error = std::current_exception();
     }
+    if (error)
+	closeFds();
+    if (logLevel > 2)
+	LogLine(*this).stream() << "received " << bytesReceived << " bytes, holding at most "
+	    << receiveHighWater << " unconsumed; " << receiveDropped << " discarded for lack of space";
+    if (error)
+	std::rethrow_exception(error);
 }
 
 ExpectProgram::~ExpectProgram()
 {
     closeFds();
-    delete[] receiveData;
+    delete receiveRing;
     delete[] sendData;
 }
 
@@ -841,6 +1861,112 @@ ExpectTimeout::execute(ExpectProgram &prog) const
     prog.timeout = value;
 }
 
+ExpectQuiet::ExpectQuiet(const char **attribs)
+    : value(0)
+{
+    for (const char **cpp = attribs; cpp[0]; cpp += 2) {
+	int count = atoi(cpp[1]);
+	if (!strcmp(cpp[0], "msec"))
+	    value = count;
+	else if (!strcmp(cpp[0], "sec"))
+	    value = count * 1000;
+    }
+}
+
+void
+ExpectQuiet::execute(ExpectProgram &prog) const
+{
+    prog.expectDelay = value;
+}
+
+/*
+ * <telnet accept="sga,binary,naws" cols="132" rows="50"/> sets the telnet
+ * options we'll agree to, by name or number, and the window size to report
+ * with NAWS. On an open connection, the named options are asked for at once.
+ */
+ExpectTelnet::ExpectTelnet(const char **attribs)
+    : setAccept(false)
+    , cols(0)
+    , rows(0)
+{
+    memset(accept, 0, sizeof accept);
+    for (const char **cpp = attribs; cpp[0]; cpp += 2) {
+	if (!strcmp(cpp[0], "cols")) {
+	    cols = atoi(cpp[1]);
+	} else if (!strcmp(cpp[0], "rows")) {
+	    rows = atoi(cpp[1]);
+	} else if (!strcmp(cpp[0], "accept")) {
+	    setAccept = true;
+	    std::string list = cpp[1];
+	    for (size_t pos = 0; pos < list.size(); ) {
+		size_t comma = list.find(',', pos);
+		if (comma == std::string::npos)
+		    comma = list.size();
+		std::string name = list.substr(pos, comma - pos);
+		pos = comma + 1;
+		if (name.empty())
+		    continue;
+		size_t i;
+		for (i = 0; i < sizeof telnetOptionNames / sizeof telnetOptionNames[0]; i++)
+		    if (name == telnetOptionNames[i].name)
+			break;
+		if (i < sizeof telnetOptionNames / sizeof telnetOptionNames[0]) {
+		    accept[telnetOptionNames[i].code] = true;
+		    continue;
+		}
+		char *end;
+		long code = strtol(name.c_str(), &end, 0);
+		if (*end != '\0' || code < 0 || code > 255)
+		    throw ExpectSyntaxException("unknown telnet option \"" + name + "\"");
+		accept[code] = true;
+	    }
+	}
+    }
+}
+
+void
+ExpectTelnet::execute(ExpectProgram &prog) const
+{
+    TelnetOptions &options = prog.telnetOptions;
+    bool resized = (cols && cols != options.cols) || (rows && rows != options.rows);
+
+    if (setAccept)
+	memcpy(options.accept, accept, sizeof accept);
+    if (cols)
+	options.cols = cols;
+    if (rows)
+	options.rows = rows;
+    if (prog.writeFd == -1 || !prog.telnet)
+	return; // attach() will make the offers.
+    if (setAccept)
+	prog.telnetOffer();
+    if (resized && options.local[TELOPT_NAWS] == TelnetOptions::Yes)
+	prog.sendWindowSize();
+}
+
+ExpectBuffer::ExpectBuffer(const char **attribs)
+    : receive(0)
+    , send(0)
+    , limit(0)
+{
+    for (const char **cpp = attribs; cpp[0]; cpp += 2) {
+	if (!strcmp(cpp[0], "receive"))
+	    receive = atoi(cpp[1]);
+	else if (!strcmp(cpp[0], "send"))
+	    send = atoi(cpp[1]);
+	else if (!strcmp(cpp[0], "max"))
+	    limit = atoi(cpp[1]);
+    }
+}
+
+void
+ExpectBuffer::execute(ExpectProgram &prog) const
+{
+    prog.setBuffers(receive ? receive : prog.receiveBase,
+	    send ? send : prog.sendBase,
+	    limit ? limit : prog.bufferLimit);
+}
+
 ExpectVariable::ExpectVariable(const char **attributes)
 {
     const char *v = ExpatParserHandlers::getAttribute(attributes, "key");
@@ -852,7 +1978,7 @@ ExpectVariable::ExpectVariable(const char **attributes)
 void
 ExpectVariable::write(ExpectProgram &program, std::ostream &os) const
 {
-    os << program.variables[key];
+    program.writeVariable(os, key);
 }
 
 ExpectTemplate::ExpectTemplate(const char **attributes)
@@ -866,11 +1992,35 @@ ExpectListen::ExpectListen(const char **attribs)
 {
 }
 
+/*
+ * A persistent listener never returns: every call it takes runs the rest of
+ * the script, from here on, in a session of its own, so there's nothing
+ * left for this program to do once it stops. It blocks its thread while
+ * it's serving calls, so it can't run in a Scheduler.
+ */
 void
 ExpectListen::execute(ExpectProgram &program) const
 {
-    program.closeFds();
-    program.readFd = program.writeFd = net.connect();
+    if (net.persistent) {
+	ListenServer server(net, nextSibling, program);
+	server.run();
+	throw ListenStoppedException();
+    }
+    attach(program, net);
+}
+
+struct PersistentListenFilter : public ExpectNodeFilter {
+    FilterResult visit(const ExpectNode *node) {
+	const ExpectListen *listen = dynamic_cast<const ExpectListen *>(node);
+	return listen && listen->persistent() ? Found : Descend;
+    }
+};
+
+const ExpectNode *
+findPersistentListen(const ExpectNode *node)
+{
+    PersistentListenFilter filter;
+    return filter.search(node);
 }
 
 
@@ -881,8 +2031,45 @@ ExpectNetwork::ExpectNetwork(const char **attribs)
 void
 ExpectNetwork::execute(ExpectProgram &program) const
 {
-    program.closeFds();
-    program.readFd = program.writeFd = net.connect();
+    program.connectStarted(this);
+    try {
+	attach(program, net);
+    }
+    catch (...) {
+	program.connectFinished(this, false);
+	throw;
+    }
+    program.connectFinished(this, true);
+    if (net.pooled())
+	program.pooled = &net;
+}
+
+void
+ExpectRelease::execute(ExpectProgram &program) const
+{
+    program.release();
+}
+
+ExpectUnix::ExpectUnix(const char **attribs)
+    : net(attribs, 0)
+{
+}
+
+void
+ExpectUnix::execute(ExpectProgram &program) const
+{
+    attach(program, net);
+}
+
+ExpectUnixListen::ExpectUnixListen(const char **attribs)
+    : net(attribs, 0)
+{
+}
+
+void
+ExpectUnixListen::execute(ExpectProgram &program) const
+{
+    attach(program, net);
 }
 
 ExpectModem::ExpectModem(const char **attribs)
@@ -893,8 +2080,7 @@ ExpectModem::ExpectModem(const char **attribs)
 void
 ExpectModem::execute(ExpectProgram &program) const
 {
-    program.closeFds();
-    program.readFd = program.writeFd = modem.connect();
+    attach(program, modem);
 }
 
 ExpectDo::ExpectDo(const char **attributes)
@@ -910,13 +2096,17 @@ ExpectDo::execute(ExpectProgram &program) const
     if (status != "")
 	program.status = status;
     const ExpectNode *oldExceptionHandler = program.exceptionHandler;
+    std::exception_ptr error;
     try {
 	executeChildren(program);
     } catch (...) {
+	error = std::current_exception(); // handlers may wait: see ExpectProgram::run
+    }
+    if (error) {
 	for (const ExpectNode *n = program.exceptionHandler; n; n = n->nextSibling)
 	    program.execute(n);
 	program.exceptionHandler = oldExceptionHandler; // Restore this, but not status.
-	throw;
+	std::rethrow_exception(error);
     }
     program.status = oldStatus;
     program.exceptionHandler = oldExceptionHandler;
@@ -992,18 +2182,36 @@ ExpectStreq::ExpectStreq(const char **)
 {
 }
 
+/*
+ * <drip rate="msec"/> sends one byte every "rate" milliseconds, as before.
+ * <drip cps="n" burst="m"/> sends n bytes a second, in writes of up to m
+ * bytes. burst defaults to what's allowed in a millisecond, or one byte.
+ * A rate of zero turns pacing off.
+ */
 ExpectDrip::ExpectDrip(const char **attributes)
     : rate(0)
-{
-    const char *p = ExpatParserHandlers::getAttribute(attributes, "rate");
-    if (p)
-	rate = atoi(p);
+    , burst(0)
+{
+    for (const char **cpp = attributes; cpp[0]; cpp += 2) {
+	if (!strcmp(cpp[0], "rate")) {
+	    int msec = atoi(cpp[1]);
+	    rate = msec > 0 ? 1000.0 / msec : 0;
+	    burst = 1;
+	} else if (!strcmp(cpp[0], "cps")) {
+	    rate = atof(cpp[1]);
+	} else if (!strcmp(cpp[0], "burst")) {
+	    burst = atof(cpp[1]);
+	}
+    }
+    if (burst == 0)
+	burst = rate / 1000;
 }
 
 void
 ExpectDrip::execute(ExpectProgram &program) const
 {
-    program.dripRate = rate;
+    program.flush(); // the new rate applies to what's sent from here on.
+    program.pacer.set(rate, burst);
 }
 
 ExpectDrip::~ExpectDrip()
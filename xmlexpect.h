@@ -5,38 +5,121 @@
 
 #ifndef xmlexpect_h_guard
 #define xmlexpect_h_guard
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <map>
+#include <ostream>
+#include <streambuf>
 #include <string>
+#include <vector>
 #include "util.h"
 #include "expatwrap.h"
+#include "pattern.h"
+#include "ringbuffer.h"
+#include "pacer.h"
+#include "trace.h"
 
 class ExpectNode;
+class ExpectProgram;
+class NetworkConnection;
 
-class ExpectProgram {
-    void stripTelnet();
+// Lets character data nodes write straight into the program's send buffer.
+class SendStreamBuf : public std::streambuf {
+    ExpectProgram &program;
+protected:
+    int overflow(int c);
+    std::streamsize xsputn(const char *data, std::streamsize len);
+public:
+    SendStreamBuf(ExpectProgram &program_) : program(program_) {}
+};
+
+// Telnet options we'll agree to, and what's been agreed so far; see <telnet>.
+struct TelnetOptions {
+    enum State { No, WantYes, Yes }; // WantYes: we've asked, and await the answer.
+    bool accept[256];
+    unsigned char local[256]; // options performed by this end...
+    unsigned char remote[256]; // ... and by the other end.
+    int cols; // window size, for NAWS.
+    int rows;
+    TelnetOptions();
+    void reset(); // forget what's been agreed, but not what's acceptable.
+};
+
+class ExpectProgram : public Waiter {
+    friend class SendStreamBuf;
+    SendStreamBuf sendStreamBuf;
+    void stripTelnet(int from);
+    void negotiate(unsigned char verb, unsigned char option);
+    void telnetReply(unsigned char verb, unsigned char option);
+    void compact();
+    void resizeReceive(int size);
+    void resizeSend(int size);
     void receiveRaw();
     void sendRaw(const char *data, int len);
+    void queue(char *data, int len);
+    void setCork(bool on);
+    void rearmQuickAck();
 public:
     const ExpectNode *exceptionHandler;
-    unsigned dripRate;
+    Pacer pacer; // see <drip>
     std::map<std::string, std::string> variables;
+    std::map<std::string, std::pair<int, int> > captures; // variables still in receiveData.
     std::string status;
     std::string matching;
     const ExpectNode *lastVisited;
     int readFd;
     int writeFd;
+    const NetworkConnection *pooled; // where the connection goes when released, if anywhere.
+    bool telnet; // see Connection
+    bool stripNul;
+    bool cork; // hold back partial segments while a flush takes several writes.
+    bool quickAck; // set TCP_QUICKACK again after every read: the kernel clears it.
+    enum { TelnetData, TelnetCommand, TelnetOption, TelnetSub, TelnetSubIac } telnetState; // how far into an IAC sequence the last read stopped.
+    unsigned char telnetVerb; // DO, DONT, WILL or WONT, in TelnetOption state.
+    TelnetOptions telnetOptions;
     int timeout;
-    int expectDelay;
+    int expectDelay; // msec to wait for more data after a read; see <quiet>
+    RingBuffer *receiveRing;
     int receiveSize;
-    char *receiveData;
+    char *receiveData; // current window on receiveRing.
+    int receiveStart; // data before this has been consumed by matches.
     int receiveOffset;
+    unsigned long receiveDropped; // unconsumed bytes discarded for lack of space.
+    unsigned long long bytesReceived; // after telnet processing.
+    unsigned long long bytesSent;
+    int receiveHighWater; // most unconsumed data held at once.
+    int receivePeak; // most unconsumed data since the buffer was last idle.
+    int receiveBase; // buffers grow from these sizes when needed...
+    int sendBase;
+    int bufferLimit; // ... up to this, and shrink back when idle.
     int sendSize;
-    char *sendData;
+    char *sendData; // copies of data that may change before it's sent.
     int sendOffset;
-    int logFacility;
+    std::vector<iovec> sendQueue; // everything waiting to be sent, in order.
+    size_t sendQueued; // bytes in sendQueue
+    size_t sendMark; // first entry of sendQueue for the current message...
+    bool inMessage; // ... if there is one.
+    std::ostream sendStream;
+    int logLevel; // 0 logs nothing, 1 events, 2 data sent and received too, 3 buffer use as well.
+    Trace *trace; // if set, log here rather than to std::clog.
+    PatternCache patterns; // for patterns that can't be compiled with the script.
+    std::map<unsigned, int> scanned; // how much unconsumed data each pattern has searched.
     ExpectProgram(int maxBuf, std::map<std::string, std::string> &);
-    int match(std::string);
+    void setBuffers(int receive, int send, int limit);
+    int match(const Pattern &, regmatch_t *matches = 0, size_t nmatch = 0);
+    int find(const Pattern &, regmatch_t *matches, size_t nmatch); // match() without consuming.
+    void consume(const regmatch_t &match);
+    void capture(const std::string &name, const regmatch_t &);
+    void saveCaptures(); // copy captures out of receiveData into variables.
+    void writeVariable(std::ostream &, const std::string &name);
     void send(const char *data, int len);
+    void logEvent(const std::string &text);
+    void logData(TraceKind kind, const iovec *iov, int count);
+    void telnetOffer(); // ask for the acceptable options not yet agreed.
+    void sendWindowSize();
+    void sendStatic(const char *data, int len); // data must outlive the next flush.
+    void startMessage();
+    void endMessage();
     void flush();
     void receive();
     void need(int);
@@ -45,7 +128,12 @@ public:
     virtual ~ExpectProgram();
     void execute(const ExpectNode *node);
     void closeFds();
+    void release(); // return the connection to its pool, or close it if it has none.
     virtual void statusUpdate(std::string); // Virtual callback for applications.
+    virtual void expectStarted(const ExpectNode *); // Callbacks around each <expect> or <choose>.
+    virtual void expectFinished(const ExpectNode *, bool matched);
+    virtual void connectStarted(const ExpectNode *); // ... and each <network>.
+    virtual void connectFinished(const ExpectNode *, bool connected);
 };
 
 class ExpectException : public Exception {
@@ -80,6 +168,7 @@ public:
     int lineNumber;
     virtual void execute(ExpectProgram &program) const;
     void executeChildren(ExpectProgram &program) const;
+    virtual void complete(); // called when the node and its children are parsed.
     ExpectNode();
     virtual ~ExpectNode();
 };
@@ -93,9 +182,14 @@ struct ExpectNodeFilter {
     const ExpectNode *search(const ExpectNode *node);
 };
 
+// A <listen persistent="true"> at or under node, if there is one. It blocks
+// its thread until it stops serving calls, so can't run in a Scheduler.
+const ExpectNode *findPersistentListen(const ExpectNode *node);
+
 class ExpectCharacterData : public ExpectNode {
 public:
     virtual void write(ExpectProgram &, std::ostream &) const = 0;
+    virtual bool literal(const char *&data, int &len) const; // false if value depends on the program.
     void execute(ExpectProgram &program) const;
 };
 